@@ -344,22 +344,31 @@ void cg::renderer::dx12_renderer::load_pipeline()
 	UINT index_offset = 0;
 	for (size_t shape_idx = 0; shape_idx != model->get_index_buffers().size(); ++shape_idx)
 	{
+		// The vertex layout carries colours, so each vertex takes the material of a face using it
+		const compact_index_buffer& shape_indices = model->get_index_buffers()[shape_idx];
+		std::vector<uint16_t> vertex_materials(model->get_vertex_buffers()[shape_idx]->get_number_of_elements(), 0);
+		for (size_t i = 0; i != shape_indices.get_number_of_elements(); ++i)
+		{
+			vertex_materials[shape_indices.item(i)] = model->get_material_id_buffers()[shape_idx]->item(i / 3);
+		}
+
 		for (size_t i = 0; i != model->get_vertex_buffers()[shape_idx]->get_number_of_elements(); ++i)
 		{
-			vertex& v = model->get_vertex_buffers()[shape_idx]->item(i);
+			const vertex v = model->get_vertex_buffers()[shape_idx]->item(i).decode(model->get_vertex_quantizations()[shape_idx]);
+			const material& m = model->get_materials()[vertex_materials[i]];
 			DirectX::XMFLOAT3 bary(i % 3 == 0, i % 3 == 1, i % 3 == 2);
 			d3d_vertex vert = {
 					DirectX::XMFLOAT4(v.position.x, v.position.y, v.position.z, 1.0f),
 					DirectX::XMFLOAT4(v.normal.x, v.normal.y, v.normal.z, 0.0f),
-					DirectX::XMFLOAT4(v.ambient.x, v.ambient.y, v.ambient.z, 1.0f),
-					DirectX::XMFLOAT4(v.diffuse.x, v.diffuse.y, v.diffuse.z, 1.0f),
-					DirectX::XMFLOAT4(v.emissive.x, v.emissive.y, v.emissive.z, 1.0f),
+					DirectX::XMFLOAT4(m.ambient.x, m.ambient.y, m.ambient.z, 1.0f),
+					DirectX::XMFLOAT4(m.diffuse.x, m.diffuse.y, m.diffuse.z, 1.0f),
+					DirectX::XMFLOAT4(m.emissive.x, m.emissive.y, m.emissive.z, 1.0f),
 					bary};
 			vertices.emplace_back(vert);
 		}
-		for (size_t i = 0; i != model->get_index_buffers()[shape_idx]->get_number_of_elements(); ++i)
+		for (size_t i = 0; i != model->get_index_buffers()[shape_idx].get_number_of_elements(); ++i)
 		{
-			UINT& ind = model->get_index_buffers()[shape_idx]->item(i);
+			const UINT ind = model->get_index_buffers()[shape_idx].item(i);
 			indices.push_back(ind + index_offset);
 		}
 		index_offset += static_cast<UINT>(model->get_vertex_buffers()[shape_idx]->get_number_of_elements());
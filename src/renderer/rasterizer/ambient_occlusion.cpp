@@ -0,0 +1,306 @@
+#include "ambient_occlusion.h"
+
+#include "utils/parallel.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <random>
+
+
+namespace
+{
+	constexpr size_t tile_size = 32;
+	constexpr int blur_radius = 4;
+}// namespace
+
+void cg::renderer::ambient_occlusion::set_resolution(size_t in_width, size_t in_height, size_t in_divider)
+{
+	divider = std::max<size_t>(in_divider, 1);
+	full_width = in_width;
+	full_height = in_height;
+	width = (in_width + divider - 1) / divider;
+	height = (in_height + divider - 1) / divider;
+
+	positions = std::make_unique<resource<DirectX::XMFLOAT3>>(width, height);
+	normals = std::make_unique<resource<DirectX::XMFLOAT3>>(width, height);
+	occlusion = std::make_unique<resource<float>>(width, height);
+	blur_buffer = std::make_unique<resource<float>>(width, height);
+
+	build_kernel();
+}
+
+void cg::renderer::ambient_occlusion::set_radius(float in_radius)
+{
+	radius = in_radius;
+}
+
+void cg::renderer::ambient_occlusion::compute(const cg::resource<float>& depth_buffer, const DirectX::XMFLOAT4X4& projection, float z_near, float z_far)
+{
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		reconstruct(depth_buffer, projection, z_near, z_far, x_begin, y_begin, x_end, y_end);
+	});
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		reconstruct_normals(x_begin, y_begin, x_end, y_end);
+	});
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		sample(projection, x_begin, y_begin, x_end, y_end);
+	});
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		blur(*occlusion, *blur_buffer, 1, 0, x_begin, y_begin, x_end, y_end);
+	});
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		blur(*blur_buffer, *occlusion, 0, 1, x_begin, y_begin, x_end, y_end);
+	});
+}
+
+float cg::renderer::ambient_occlusion::get(size_t x, size_t y) const
+{
+	return occlusion->item(std::min(x / divider, width - 1), std::min(y / divider, height - 1));
+}
+
+const cg::resource<float>& cg::renderer::ambient_occlusion::get_buffer() const
+{
+	return *occlusion;
+}
+
+void cg::renderer::ambient_occlusion::build_kernel()
+{
+	std::mt19937 generator(0);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	for (size_t i = 0; i != num_samples; ++i) {
+		DirectX::XMVECTOR direction = DirectX::XMVector3Normalize(DirectX::XMVectorSet(
+				unit(generator) * 2.0f - 1.0f,
+				unit(generator) * 2.0f - 1.0f,
+				unit(generator),
+				0.0f));
+
+		// Pack more samples close to the shaded point
+		const float t = static_cast<float>(i) / static_cast<float>(num_samples);
+		direction = DirectX::XMVectorScale(direction, unit(generator) * (0.1f + 0.9f * t * t));
+
+		DirectX::XMFLOAT3 sample;
+		DirectX::XMStoreFloat3(&sample, direction);
+		(&kernel_x[i / 4].x)[i % 4] = sample.x;
+		(&kernel_y[i / 4].x)[i % 4] = sample.y;
+		(&kernel_z[i / 4].x)[i % 4] = sample.z;
+	}
+
+	for (DirectX::XMFLOAT3& reflection: noise) {
+		const DirectX::XMVECTOR direction = DirectX::XMVectorSet(
+				unit(generator) * 2.0f - 1.0f,
+				unit(generator) * 2.0f - 1.0f,
+				unit(generator) * 2.0f - 1.0f,
+				0.0f);
+		DirectX::XMStoreFloat3(&reflection, DirectX::XMVector3Normalize(direction));
+	}
+}
+
+void cg::renderer::ambient_occlusion::reconstruct(const cg::resource<float>& depth_buffer, const DirectX::XMFLOAT4X4& projection,
+												  float z_near, float z_far,
+												  size_t x_begin, size_t y_begin, size_t x_end, size_t y_end)
+{
+	for (size_t y = y_begin; y != y_end; ++y) {
+		for (size_t x = x_begin; x != x_end; ++x) {
+			// The closest depth of the block keeps thin foreground edges
+			float depth = FLT_MAX;
+			for (size_t fy = y * divider; fy != std::min((y + 1) * divider, full_height); ++fy) {
+				for (size_t fx = x * divider; fx != std::min((x + 1) * divider, full_width); ++fx) {
+					depth = std::min(depth, depth_buffer.item(fx, fy));
+				}
+			}
+
+			DirectX::XMFLOAT3& position = positions->item(x, y);
+			if (depth >= z_far) {
+				position = {0.0f, 0.0f, FLT_MAX};
+				continue;
+			}
+
+			const float ndc_z = (depth - z_near) / (z_far - z_near);
+			const float view_z = z_near * z_far / (z_far - ndc_z * (z_far - z_near));
+			const float ndc_x = (static_cast<float>(x) + 0.5f) * static_cast<float>(divider) / static_cast<float>(full_width) * 2.0f - 1.0f;
+			const float ndc_y = 1.0f - (static_cast<float>(y) + 0.5f) * static_cast<float>(divider) / static_cast<float>(full_height) * 2.0f;
+			position = {ndc_x * view_z / projection._11, ndc_y * view_z / projection._22, view_z};
+		}
+	}
+}
+
+void cg::renderer::ambient_occlusion::reconstruct_normals(size_t x_begin, size_t y_begin, size_t x_end, size_t y_end)
+{
+	using namespace DirectX;
+
+	auto fetch = [this](size_t x, size_t y, int dx, int dy, XMVECTOR& result) {
+		const long long nx = static_cast<long long>(x) + dx;
+		const long long ny = static_cast<long long>(y) + dy;
+		if (nx < 0 || ny < 0 || nx >= static_cast<long long>(width) || ny >= static_cast<long long>(height)) {
+			return false;
+		}
+		const XMFLOAT3& neighbour = positions->item(static_cast<size_t>(nx), static_cast<size_t>(ny));
+		if (neighbour.z == FLT_MAX) {
+			return false;
+		}
+		result = XMLoadFloat3(&neighbour);
+		return true;
+	};
+
+	// Of the two one-sided differences, the one with the smaller depth step stays on the same surface
+	auto derivative = [](XMVECTOR center, bool has_minus, XMVECTOR minus, bool has_plus, XMVECTOR plus, XMVECTOR& result) {
+		if (has_minus && has_plus) {
+			const float d_minus = std::abs(XMVectorGetZ(center) - XMVectorGetZ(minus));
+			const float d_plus = std::abs(XMVectorGetZ(plus) - XMVectorGetZ(center));
+			result = d_minus < d_plus ? XMVectorSubtract(center, minus) : XMVectorSubtract(plus, center);
+		}
+		else if (has_minus) {
+			result = XMVectorSubtract(center, minus);
+		}
+		else if (has_plus) {
+			result = XMVectorSubtract(plus, center);
+		}
+		return has_minus || has_plus;
+	};
+
+	for (size_t y = y_begin; y != y_end; ++y) {
+		for (size_t x = x_begin; x != x_end; ++x) {
+			const XMFLOAT3& position = positions->item(x, y);
+			if (position.z == FLT_MAX) {
+				normals->item(x, y) = {0.0f, 0.0f, 0.0f};
+				continue;
+			}
+			const XMVECTOR center = XMLoadFloat3(&position);
+
+			XMVECTOR left = XMVectorZero(), right = left, up = left, down = left, ddx = left, ddy = left;
+			const bool has_left = fetch(x, y, -1, 0, left);
+			const bool has_right = fetch(x, y, 1, 0, right);
+			const bool has_up = fetch(x, y, 0, -1, up);
+			const bool has_down = fetch(x, y, 0, 1, down);
+
+			XMVECTOR normal;
+			if (derivative(center, has_left, left, has_right, right, ddx) && derivative(center, has_up, up, has_down, down, ddy)) {
+				normal = XMVector3Cross(ddx, ddy);
+			}
+			else {
+				normal = XMVectorNegate(center);
+			}
+			normal = XMVector3Normalize(normal);
+			if (XMVectorGetX(XMVector3Dot(normal, center)) > 0.0f) {
+				normal = XMVectorNegate(normal);
+			}
+			XMStoreFloat3(&normals->item(x, y), normal);
+		}
+	}
+}
+
+void cg::renderer::ambient_occlusion::sample(const DirectX::XMFLOAT4X4& projection, size_t x_begin, size_t y_begin, size_t x_end, size_t y_end)
+{
+	using namespace DirectX;
+
+	const XMVECTOR sample_radius = XMVectorReplicate(radius);
+	const XMVECTOR depth_bias = XMVectorReplicate(0.05f * radius);
+	const XMVECTOR two = XMVectorReplicate(2.0f);
+	const XMVECTOR scale_x = XMVectorReplicate(0.5f * projection._11 * static_cast<float>(full_width) / static_cast<float>(divider));
+	const XMVECTOR scale_y = XMVectorReplicate(-0.5f * projection._22 * static_cast<float>(full_height) / static_cast<float>(divider));
+	const XMVECTOR offset_x = XMVectorReplicate(0.5f * static_cast<float>(full_width) / static_cast<float>(divider));
+	const XMVECTOR offset_y = XMVectorReplicate(0.5f * static_cast<float>(full_height) / static_cast<float>(divider));
+
+	for (size_t y = y_begin; y != y_end; ++y) {
+		for (size_t x = x_begin; x != x_end; ++x) {
+			const XMFLOAT3& position = positions->item(x, y);
+			if (position.z == FLT_MAX) {
+				occlusion->item(x, y) = 1.0f;
+				continue;
+			}
+			const XMFLOAT3& normal = normals->item(x, y);
+			const XMFLOAT3& reflection = noise[(y % 4) * 4 + x % 4];
+
+			const XMVECTOR px = XMVectorReplicate(position.x), py = XMVectorReplicate(position.y), pz = XMVectorReplicate(position.z);
+			const XMVECTOR nx = XMVectorReplicate(normal.x), ny = XMVectorReplicate(normal.y), nz = XMVectorReplicate(normal.z);
+			const XMVECTOR rx = XMVectorReplicate(reflection.x), ry = XMVectorReplicate(reflection.y), rz = XMVectorReplicate(reflection.z);
+
+			// Four kernel samples per iteration: reflect, flip into the normal's hemisphere,
+			// project to the occlusion grid and compare against the stored depth
+			XMVECTOR occluded_sum = XMVectorZero();
+			for (size_t group = 0; group != num_samples / 4; ++group) {
+				XMVECTOR kx = XMLoadFloat4(&kernel_x[group]);
+				XMVECTOR ky = XMLoadFloat4(&kernel_y[group]);
+				XMVECTOR kz = XMLoadFloat4(&kernel_z[group]);
+
+				const XMVECTOR k_dot_r = XMVectorMultiply(two, XMVectorMultiplyAdd(kx, rx, XMVectorMultiplyAdd(ky, ry, XMVectorMultiply(kz, rz))));
+				kx = XMVectorNegativeMultiplySubtract(k_dot_r, rx, kx);
+				ky = XMVectorNegativeMultiplySubtract(k_dot_r, ry, ky);
+				kz = XMVectorNegativeMultiplySubtract(k_dot_r, rz, kz);
+
+				const XMVECTOR k_dot_n = XMVectorMultiplyAdd(kx, nx, XMVectorMultiplyAdd(ky, ny, XMVectorMultiply(kz, nz)));
+				const XMVECTOR below = XMVectorLess(k_dot_n, XMVectorZero());
+				kx = XMVectorSelect(kx, XMVectorNegate(kx), below);
+				ky = XMVectorSelect(ky, XMVectorNegate(ky), below);
+				kz = XMVectorSelect(kz, XMVectorNegate(kz), below);
+
+				const XMVECTOR sx = XMVectorMultiplyAdd(kx, sample_radius, px);
+				const XMVECTOR sy = XMVectorMultiplyAdd(ky, sample_radius, py);
+				const XMVECTOR sz = XMVectorMultiplyAdd(kz, sample_radius, pz);
+
+				const XMVECTOR inverse_z = XMVectorReciprocal(sz);
+				XMFLOAT4 u, v;
+				XMStoreFloat4(&u, XMVectorMultiplyAdd(XMVectorMultiply(sx, inverse_z), scale_x, offset_x));
+				XMStoreFloat4(&v, XMVectorMultiplyAdd(XMVectorMultiply(sy, inverse_z), scale_y, offset_y));
+
+				XMFLOAT4 scene_z;
+				for (size_t lane = 0; lane != 4; ++lane) {
+					const float lane_u = (&u.x)[lane];
+					const float lane_v = (&v.x)[lane];
+					float& lane_z = (&scene_z.x)[lane];
+					if (lane_u < 0.0f || lane_v < 0.0f || lane_u >= static_cast<float>(width) || lane_v >= static_cast<float>(height)) {
+						lane_z = FLT_MAX;
+					}
+					else {
+						lane_z = positions->item(static_cast<size_t>(lane_u), static_cast<size_t>(lane_v)).z;
+					}
+				}
+				const XMVECTOR occluder_z = XMLoadFloat4(&scene_z);
+
+				// Occluders far outside the sampling radius fade out instead of darkening silhouettes
+				const XMVECTOR occluded = XMVectorLess(occluder_z, XMVectorSubtract(sz, depth_bias));
+				const XMVECTOR range = XMVectorSaturate(XMVectorDivide(sample_radius, XMVectorAbs(XMVectorSubtract(pz, occluder_z))));
+				occluded_sum = XMVectorAdd(occluded_sum, XMVectorSelect(XMVectorZero(), range, occluded));
+			}
+
+			const float occluded_fraction = XMVectorGetX(XMVectorSum(occluded_sum)) / static_cast<float>(num_samples);
+			occlusion->item(x, y) = std::clamp(1.0f - occluded_fraction, 0.0f, 1.0f);
+		}
+	}
+}
+
+void cg::renderer::ambient_occlusion::blur(const cg::resource<float>& source, cg::resource<float>& destination, int step_x, int step_y,
+										   size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) const
+{
+	constexpr float sigma = 0.5f * blur_radius;
+	constexpr float depth_sharpness = 10.0f;
+
+	for (size_t y = y_begin; y != y_end; ++y) {
+		for (size_t x = x_begin; x != x_end; ++x) {
+			const float center_z = positions->item(x, y).z;
+			if (center_z == FLT_MAX) {
+				destination.item(x, y) = 1.0f;
+				continue;
+			}
+
+			// Gaussian taps that stop at depth discontinuities
+			float sum = 0.0f;
+			float weight_sum = 0.0f;
+			for (int i = -blur_radius; i <= blur_radius; ++i) {
+				const long long tx = static_cast<long long>(x) + i * step_x;
+				const long long ty = static_cast<long long>(y) + i * step_y;
+				if (tx < 0 || ty < 0 || tx >= static_cast<long long>(width) || ty >= static_cast<long long>(height)) {
+					continue;
+				}
+				const float tap_z = positions->item(static_cast<size_t>(tx), static_cast<size_t>(ty)).z;
+				const float depth_weight = std::max(0.0f, 1.0f - depth_sharpness * std::abs(tap_z - center_z) / center_z);
+				const float weight = std::exp(-static_cast<float>(i * i) / (2.0f * sigma * sigma)) * depth_weight;
+				sum += weight * source.item(static_cast<size_t>(tx), static_cast<size_t>(ty));
+				weight_sum += weight;
+			}
+			destination.item(x, y) = weight_sum > 0.0f ? sum / weight_sum : source.item(x, y);
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "resource.h"
+
+#include <DirectXMath.h>
+#include <array>
+
+
+namespace cg::renderer
+{
+	// Screen-space ambient occlusion computed from a depth buffer written with a
+	// [z_near, z_far] viewport depth range, at a reduced resolution
+	class ambient_occlusion
+	{
+	public:
+		static constexpr size_t num_samples = 16;
+
+		void set_resolution(size_t in_width, size_t in_height, size_t in_divider);
+		void set_radius(float in_radius);
+
+		void compute(const cg::resource<float>& depth_buffer, const DirectX::XMFLOAT4X4& projection, float z_near, float z_far);
+
+		// Visibility in [0, 1] for a full resolution pixel
+		float get(size_t x, size_t y) const;
+
+		const cg::resource<float>& get_buffer() const;
+
+	protected:
+		size_t full_width = 0;
+		size_t full_height = 0;
+		size_t width = 0;
+		size_t height = 0;
+		size_t divider = 2;
+		float radius = 0.1f;
+
+		std::unique_ptr<cg::resource<DirectX::XMFLOAT3>> positions;
+		std::unique_ptr<cg::resource<DirectX::XMFLOAT3>> normals;
+		std::unique_ptr<cg::resource<float>> occlusion;
+		std::unique_ptr<cg::resource<float>> blur_buffer;
+
+		// Hemisphere kernel stored as structure of arrays, four samples per vector
+		std::array<DirectX::XMFLOAT4, num_samples / 4> kernel_x;
+		std::array<DirectX::XMFLOAT4, num_samples / 4> kernel_y;
+		std::array<DirectX::XMFLOAT4, num_samples / 4> kernel_z;
+
+		// Tiled 4x4 set of random reflection vectors, the blur removes the pattern
+		std::array<DirectX::XMFLOAT3, 16> noise;
+
+		void build_kernel();
+		void reconstruct(const cg::resource<float>& depth_buffer, const DirectX::XMFLOAT4X4& projection, float z_near, float z_far,
+						 size_t x_begin, size_t y_begin, size_t x_end, size_t y_end);
+		void reconstruct_normals(size_t x_begin, size_t y_begin, size_t x_end, size_t y_end);
+		void sample(const DirectX::XMFLOAT4X4& projection, size_t x_begin, size_t y_begin, size_t x_end, size_t y_end);
+		void blur(const cg::resource<float>& source, cg::resource<float>& destination, int step_x, int step_y,
+				  size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) const;
+	};
+}// namespace cg::renderer
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "resource.h"
+
+#include <memory>
+#include <variant>
+#include <vector>
+
+
+namespace cg::renderer
+{
+	// Records rasterizer state changes and draws for later, in-order execution by rasterizer::execute.
+	// Separate lists may be recorded concurrently; recording touches no rasterizer state.
+	template<typename VB>
+	class command_list
+	{
+	public:
+		struct set_vertex_buffer_command
+		{
+			std::shared_ptr<cg::resource<VB>> vertex_buffer;
+		};
+		struct set_index_buffer_command
+		{
+			cg::compact_index_buffer index_buffer;
+		};
+		struct set_draw_constant_command
+		{
+			size_t value;
+		};
+		struct draw_command
+		{
+			size_t num_indices;
+			size_t first_index;
+		};
+		using command = std::variant<set_vertex_buffer_command, set_index_buffer_command, set_draw_constant_command, draw_command>;
+
+		void reset();
+
+		void set_vertex_buffer(std::shared_ptr<cg::resource<VB>> in_vertex_buffer);
+		void set_index_buffer(const cg::compact_index_buffer& in_index_buffer);
+		void set_draw_constant(size_t value);
+		void draw(size_t num_indices, size_t first_index = 0);
+
+		const std::vector<command>& get_commands() const;
+		size_t get_number_of_draws() const;
+
+	protected:
+		std::vector<command> commands;
+		size_t number_of_draws = 0;
+	};
+
+	template<typename VB>
+	inline void command_list<VB>::reset()
+	{
+		commands.clear();
+		number_of_draws = 0;
+	}
+
+	template<typename VB>
+	inline void command_list<VB>::set_vertex_buffer(std::shared_ptr<cg::resource<VB>> in_vertex_buffer)
+	{
+		commands.emplace_back(set_vertex_buffer_command{in_vertex_buffer});
+	}
+
+	template<typename VB>
+	inline void command_list<VB>::set_index_buffer(const cg::compact_index_buffer& in_index_buffer)
+	{
+		commands.emplace_back(set_index_buffer_command{in_index_buffer});
+	}
+
+	template<typename VB>
+	inline void command_list<VB>::set_draw_constant(size_t value)
+	{
+		commands.emplace_back(set_draw_constant_command{value});
+	}
+
+	template<typename VB>
+	inline void command_list<VB>::draw(size_t num_indices, size_t first_index)
+	{
+		commands.emplace_back(draw_command{num_indices, first_index});
+		++number_of_draws;
+	}
+
+	template<typename VB>
+	inline const std::vector<typename command_list<VB>::command>& command_list<VB>::get_commands() const
+	{
+		return commands;
+	}
+
+	template<typename VB>
+	inline size_t command_list<VB>::get_number_of_draws() const
+	{
+		return number_of_draws;
+	}
+}// namespace cg::renderer
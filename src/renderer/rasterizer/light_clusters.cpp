@@ -0,0 +1,145 @@
+#include "light_clusters.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+void cg::renderer::light_clusters::set_grid(size_t in_width, size_t in_height, size_t in_tile_size, size_t in_depth_slices)
+{
+	width = in_width;
+	height = in_height;
+	tile_size = in_tile_size;
+	depth_slices = in_depth_slices;
+	tiles_x = (width + tile_size - 1) / tile_size;
+	tiles_y = (height + tile_size - 1) / tile_size;
+	clusters.assign(tiles_x * tiles_y * depth_slices, {0, 0});
+}
+
+void cg::renderer::light_clusters::build(const std::vector<cg::world::point_light>& lights, const cg::world::camera& camera)
+{
+	using namespace DirectX;
+
+	z_near = camera.get_z_near();
+	z_far = camera.get_z_far();
+
+	const XMMATRIX view = camera.get_view_matrix();
+	const XMMATRIX projection = camera.get_projection_matrix();
+
+	struct cluster_bounds
+	{
+		size_t x_from, x_to, y_from, y_to, z_from, z_to;
+	};
+	std::vector<cluster_bounds> light_bounds(lights.size());
+	std::vector<bool> visible(lights.size(), false);
+
+	for (size_t i = 0; i != lights.size(); ++i) {
+		const cg::world::point_light& light = lights[i];
+		const XMVECTOR center = XMVector3TransformCoord(XMLoadFloat3(&light.position), view);
+		const float center_z = XMVectorGetZ(center);
+
+		if (center_z + light.range < z_near || center_z - light.range > z_far) {
+			continue;
+		}
+
+		cluster_bounds& bounds = light_bounds[i];
+		bounds.z_from = get_depth_slice(center_z - light.range);
+		bounds.z_to = get_depth_slice(center_z + light.range);
+
+		// Lights straddling the near plane cannot be projected and cover the whole screen
+		bounds.x_from = 0;
+		bounds.x_to = tiles_x - 1;
+		bounds.y_from = 0;
+		bounds.y_to = tiles_y - 1;
+
+		if (center_z - light.range > z_near) {
+			float x_min = FLT_MAX, x_max = -FLT_MAX, y_min = FLT_MAX, y_max = -FLT_MAX;
+			for (int corner = 0; corner != 8; ++corner) {
+				const XMVECTOR offset = XMVectorSet(
+						(corner & 1) ? light.range : -light.range,
+						(corner & 2) ? light.range : -light.range,
+						(corner & 4) ? light.range : -light.range,
+						0.0f);
+				const XMVECTOR ndc = XMVector3TransformCoord(XMVectorAdd(center, offset), projection);
+				const float screen_x = (XMVectorGetX(ndc) * 0.5f + 0.5f) * static_cast<float>(width);
+				const float screen_y = (0.5f - XMVectorGetY(ndc) * 0.5f) * static_cast<float>(height);
+				x_min = std::min(x_min, screen_x);
+				x_max = std::max(x_max, screen_x);
+				y_min = std::min(y_min, screen_y);
+				y_max = std::max(y_max, screen_y);
+			}
+
+			if (x_max < 0.0f || y_max < 0.0f || x_min >= static_cast<float>(width) || y_min >= static_cast<float>(height)) {
+				continue;
+			}
+
+			auto to_tile = [this](float coordinate, size_t num_tiles) {
+				const float tile = std::floor(coordinate / static_cast<float>(tile_size));
+				return static_cast<size_t>(std::clamp(tile, 0.0f, static_cast<float>(num_tiles - 1)));
+			};
+			bounds.x_from = to_tile(x_min, tiles_x);
+			bounds.x_to = to_tile(x_max, tiles_x);
+			bounds.y_from = to_tile(y_min, tiles_y);
+			bounds.y_to = to_tile(y_max, tiles_y);
+		}
+
+		visible[i] = true;
+	}
+
+	// Count, prefix sum and fill, so every cluster's lights are contiguous
+	for (cluster_range& cluster: clusters) {
+		cluster = {0, 0};
+	}
+	auto for_each_cluster = [this](const cluster_bounds& bounds, auto&& action) {
+		for (size_t z = bounds.z_from; z <= bounds.z_to; ++z) {
+			for (size_t y = bounds.y_from; y <= bounds.y_to; ++y) {
+				for (size_t x = bounds.x_from; x <= bounds.x_to; ++x) {
+					action(clusters[(z * tiles_y + y) * tiles_x + x]);
+				}
+			}
+		}
+	};
+
+	for (size_t i = 0; i != lights.size(); ++i) {
+		if (visible[i]) {
+			for_each_cluster(light_bounds[i], [](cluster_range& cluster) { ++cluster.count; });
+		}
+	}
+
+	unsigned int offset = 0;
+	for (cluster_range& cluster: clusters) {
+		cluster.offset = offset;
+		offset += cluster.count;
+		cluster.count = 0;
+	}
+
+	light_indices.resize(offset);
+	for (size_t i = 0; i != lights.size(); ++i) {
+		if (visible[i]) {
+			for_each_cluster(light_bounds[i], [this, i](cluster_range& cluster) {
+				light_indices[cluster.offset + cluster.count++] = static_cast<unsigned int>(i);
+			});
+		}
+	}
+}
+
+cg::renderer::light_clusters::cluster_range cg::renderer::light_clusters::get_cluster(size_t x, size_t y, float view_depth) const
+{
+	const size_t tile_x = std::min(x / tile_size, tiles_x - 1);
+	const size_t tile_y = std::min(y / tile_size, tiles_y - 1);
+	return clusters[(get_depth_slice(view_depth) * tiles_y + tile_y) * tiles_x + tile_x];
+}
+
+unsigned int cg::renderer::light_clusters::get_light_index(size_t i) const
+{
+	return light_indices[i];
+}
+
+size_t cg::renderer::light_clusters::get_depth_slice(float view_depth) const
+{
+	if (view_depth <= z_near) {
+		return 0;
+	}
+	const float slice = std::log(view_depth / z_near) / std::log(z_far / z_near) * static_cast<float>(depth_slices);
+	return std::min(static_cast<size_t>(slice), depth_slices - 1);
+}
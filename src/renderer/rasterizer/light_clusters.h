@@ -0,0 +1,45 @@
+#pragma once
+
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <DirectXMath.h>
+#include <vector>
+
+
+namespace cg::renderer
+{
+	// Screen tiles x exponential depth slices, each holding the indices of the lights reaching into it
+	class light_clusters
+	{
+	public:
+		struct cluster_range
+		{
+			unsigned int offset;
+			unsigned int count;
+		};
+
+		void set_grid(size_t in_width, size_t in_height, size_t in_tile_size, size_t in_depth_slices);
+
+		void build(const std::vector<cg::world::point_light>& lights, const cg::world::camera& camera);
+
+		cluster_range get_cluster(size_t x, size_t y, float view_depth) const;
+		unsigned int get_light_index(size_t i) const;
+
+	protected:
+		size_t width = 0;
+		size_t height = 0;
+		size_t tile_size = 64;
+		size_t tiles_x = 0;
+		size_t tiles_y = 0;
+		size_t depth_slices = 24;
+
+		float z_near = 0.001f;
+		float z_far = 100.0f;
+
+		std::vector<cluster_range> clusters;
+		std::vector<unsigned int> light_indices;
+
+		size_t get_depth_slice(float view_depth) const;
+	};
+}// namespace cg::renderer
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "renderer/rasterizer/command_list.h"
 #include "resource.h"
 
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
@@ -12,6 +16,102 @@ using namespace linalg::aliases;
 
 namespace cg::renderer
 {
+	// Lanes are ordered (x, y), (x + 1, y), (x, y + 1), (x + 1, y + 1).
+	// Helper lanes are shaded to provide derivatives but have mask set to false
+	template<typename VB>
+	struct pixel_quad
+	{
+		std::array<VB, 4> data;
+		std::array<float, 4> b;
+		std::array<float, 4> z;
+		std::array<bool, 4> mask;
+
+		VB ddx;
+		VB ddy;
+	};
+
+	// Pixel block covered by a single pixel shader invocation, width x height
+	enum class shading_rate : uint8_t
+	{
+		rate_1x1,
+		rate_1x2,
+		rate_2x2,
+		rate_4x4
+	};
+
+	inline uint2 get_shading_rate_size(shading_rate rate)
+	{
+		switch (rate) {
+			case shading_rate::rate_1x2:
+				return {1, 2};
+			case shading_rate::rate_2x2:
+				return {2, 2};
+			case shading_rate::rate_4x4:
+				return {4, 4};
+			default:
+				return {1, 1};
+		}
+	}
+
+	// What covers a pixel: the draw constant of its draw and the triangle within that draw
+	struct visibility_sample
+	{
+		static constexpr uint32_t invalid = UINT32_MAX;
+
+		uint32_t draw_constant = invalid;
+		uint32_t primitive_id = invalid;
+	};
+
+	struct rasterizer_statistics
+	{
+		size_t triangles_submitted = 0;
+		size_t triangles_culled_depth_range = 0;
+		size_t triangles_culled_off_screen = 0;
+		// On screen, but too small to cover any pixel centre
+		size_t triangles_culled_no_coverage = 0;
+		size_t triangles_culled_degenerate = 0;
+		size_t triangles_rasterized = 0;
+		size_t pixels_tested = 0;
+		size_t depth_passes = 0;
+		size_t pixel_shader_invocations = 0;
+		size_t pixels_broadcast = 0;
+
+		size_t triangles_culled() const
+		{
+			return triangles_culled_depth_range + triangles_culled_off_screen + triangles_culled_no_coverage + triangles_culled_degenerate;
+		}
+
+		rasterizer_statistics& operator+=(const rasterizer_statistics& other)
+		{
+			triangles_submitted += other.triangles_submitted;
+			triangles_culled_depth_range += other.triangles_culled_depth_range;
+			triangles_culled_off_screen += other.triangles_culled_off_screen;
+			triangles_culled_no_coverage += other.triangles_culled_no_coverage;
+			triangles_culled_degenerate += other.triangles_culled_degenerate;
+			triangles_rasterized += other.triangles_rasterized;
+			pixels_tested += other.pixels_tested;
+			depth_passes += other.depth_passes;
+			pixel_shader_invocations += other.pixel_shader_invocations;
+			pixels_broadcast += other.pixels_broadcast;
+			return *this;
+		}
+	};
+
+	inline std::ostream& operator<<(std::ostream& stream, const rasterizer_statistics& statistics)
+	{
+		return stream << "triangles: " << statistics.triangles_submitted << " submitted, "
+					  << statistics.triangles_culled() << " culled ("
+					  << statistics.triangles_culled_depth_range << " depth range, "
+					  << statistics.triangles_culled_off_screen << " off screen, "
+					  << statistics.triangles_culled_no_coverage << " no coverage, "
+					  << statistics.triangles_culled_degenerate << " degenerate), "
+					  << statistics.triangles_rasterized << " rasterized; pixels: "
+					  << statistics.pixels_tested << " tested, "
+					  << statistics.depth_passes << " passed depth, "
+					  << statistics.pixel_shader_invocations << " shaded, "
+					  << statistics.pixels_broadcast << " broadcast";
+	}
+
 	template<typename VB, typename RT>
 	class rasterizer
 	{
@@ -26,25 +126,88 @@ namespace cg::renderer
 
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		void set_index_buffer(std::shared_ptr<resource<uint16_t>> in_index_buffer);
+		void set_index_buffer(const compact_index_buffer& in_index_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		// Limits rasterization and clears to [left, right) x [top, bottom), set_viewport resets it
+		void set_scissor(size_t in_left, size_t in_top, size_t in_right, size_t in_bottom);
+		void set_depth_range(float in_min_depth, float in_max_depth);
+
+		// Counts depth passes per pixel, cleared together with the render target
+		void set_overdraw_buffer(std::shared_ptr<resource<unsigned int>> in_overdraw_buffer);
+		// Records the closest triangle per pixel, cleared together with the render target
+		void set_visibility_buffer(std::shared_ptr<resource<visibility_sample>> in_visibility_buffer);
+
+		// One rate per tile_size x tile_size screen tile, tile_size must be a multiple of 4.
+		// Applies to the per-pixel path; coarse blocks are aligned to the screen grid
+		void set_shading_rate_image(std::shared_ptr<resource<shading_rate>> in_shading_rate_image, size_t in_tile_size);
+
+		// Index of the triangle within the current draw, valid inside the pixel shaders
+		size_t get_primitive_id() const;
+
+		// Opaque per-draw value for the shaders, like a root constant
+		void set_draw_constant(size_t value);
+		size_t get_draw_constant() const;
+
+		const rasterizer_statistics& get_draw_statistics() const;
+		const rasterizer_statistics& get_frame_statistics() const;
+		void reset_frame_statistics();
+
+		void draw(size_t num_indices, size_t first_index = 0);
 
-		void draw(size_t num_indices);
+		// Replays a recorded list; after_draw receives the ordinal of each finished draw in the list
+		void execute(const command_list<VB>& list, const std::function<void(size_t draw_index)>& after_draw = nullptr);
 
-		std::function<VB(VB vertex_data)> vertex_shader;
-		std::function<cg::color(const VB& vertex_data, const float b, const float z)> pixel_shader;
+		// Decodes the stored vertex format into the interpolated vertex
+		std::function<vertex(const VB& vertex_data)> vertex_shader;
+		std::function<cg::color(const vertex& vertex_data, const float b, const float z)> pixel_shader;
+		// When set, replaces pixel_shader and is invoked once per 2x2 quad
+		std::function<void(const pixel_quad<vertex>& quad, std::array<cg::color, 4>& output)> quad_pixel_shader;
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		std::shared_ptr<cg::resource<uint16_t>> index_buffer16;
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<unsigned int>> overdraw_buffer;
+		std::shared_ptr<cg::resource<visibility_sample>> visibility_buffer;
+
+		std::shared_ptr<cg::resource<shading_rate>> shading_rate_image;
+		size_t shading_rate_tile = 16;
+		// Colour shaded for each coarse block, valid while its stamp matches the current triangle
+		std::vector<RT> coarse_colors;
+		std::vector<uint32_t> coarse_stamps;
+		uint32_t shading_stamp = 0;
+
+		rasterizer_statistics draw_statistics;
+		rasterizer_statistics frame_statistics;
+
+		size_t primitive_id = 0;
+		size_t draw_constant = 0;
 
 		size_t width = 3440;
 		size_t height = 1440;
 
+		size_t scissor_left = 0;
+		size_t scissor_top = 0;
+		size_t scissor_right = 3440;
+		size_t scissor_bottom = 1440;
+
+		float min_depth = -FLT_MAX;
+		float max_depth = FLT_MAX;
+
 		float edge_function(float2 a, float2 b, float2 c);
 		bool depth_test(float z, size_t x, size_t y);
+		bool get_coarse_anchor(size_t x, size_t y, size_t& anchor) const;
+		// Coarse blocks are indexed by their anchor pixel, so these follow the viewport size
+		void resize_coarse_buffers();
+
+		unsigned int fetch_index(size_t i) const;
+
+		void rasterize_quads(const std::array<vertex, 3>& face, const std::array<float3, 3>& vertices,
+							 int xfrom, int xto, int yfrom, int yto);
 	};
 
 	template<typename VB, typename RT>
@@ -61,19 +224,35 @@ namespace cg::renderer
 			const float in_depth)
 	{
 		if (render_target) {
-			for (size_t y = 0; y != height; ++y) {
-				for (size_t x = 0; x != width; ++x) {
+			for (size_t y = scissor_top; y != scissor_bottom; ++y) {
+				for (size_t x = scissor_left; x != scissor_right; ++x) {
 					render_target->item(x, y) = unsigned_color::from_float3({float(x) / width, float(y) / height, 1});
 				}
 			}
 		}
 		if (depth_buffer) {
-			for (size_t y = 0; y != height; ++y) {
-				for (size_t x = 0; x != width; ++x) {
+			for (size_t y = scissor_top; y != scissor_bottom; ++y) {
+				for (size_t x = scissor_left; x != scissor_right; ++x) {
 					depth_buffer->item(x, y) = in_depth;
 				}
 			}
 		}
+		if (overdraw_buffer) {
+			for (size_t y = scissor_top; y != scissor_bottom; ++y) {
+				for (size_t x = scissor_left; x != scissor_right; ++x) {
+					overdraw_buffer->item(x, y) = 0;
+				}
+			}
+		}
+		if (visibility_buffer) {
+			for (size_t y = scissor_top; y != scissor_bottom; ++y) {
+				for (size_t x = scissor_left; x != scissor_right; ++x) {
+					visibility_buffer->item(x, y) = visibility_sample{};
+				}
+			}
+		}
+		std::fill(coarse_stamps.begin(), coarse_stamps.end(), 0);
+		shading_stamp = 0;
 	}
 
 	template<typename VB, typename RT>
@@ -88,6 +267,29 @@ namespace cg::renderer
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		index_buffer = in_index_buffer;
+		index_buffer16 = nullptr;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_index_buffer(
+			std::shared_ptr<resource<uint16_t>> in_index_buffer)
+	{
+		index_buffer = nullptr;
+		index_buffer16 = in_index_buffer;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_index_buffer(
+			const compact_index_buffer& in_index_buffer)
+	{
+		index_buffer = in_index_buffer.indices32;
+		index_buffer16 = in_index_buffer.indices16;
+	}
+
+	template<typename VB, typename RT>
+	inline unsigned int rasterizer<VB, RT>::fetch_index(size_t i) const
+	{
+		return index_buffer16 ? index_buffer16->item(i) : index_buffer->item(i);
 	}
 
 	template<typename VB, typename RT>
@@ -95,37 +297,194 @@ namespace cg::renderer
 	{
 		width = in_width;
 		height = in_height;
+		set_scissor(0, 0, width, height);
+		if (shading_rate_image) {
+			resize_coarse_buffers();
+		}
 	}
 
 	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_indices)
+	inline void rasterizer<VB, RT>::set_scissor(size_t in_left, size_t in_top, size_t in_right, size_t in_bottom)
 	{
-		for (size_t face_idx = 0; face_idx != num_indices / 3; ++face_idx) {
+		scissor_left = std::min(in_left, width);
+		scissor_top = std::min(in_top, height);
+		scissor_right = std::clamp(in_right, scissor_left, width);
+		scissor_bottom = std::clamp(in_bottom, scissor_top, height);
+	}
 
-			std::array<vertex, 3> face{};
-			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_buffer->item(index_buffer->item(3 * face_idx + i));
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_depth_range(float in_min_depth, float in_max_depth)
+	{
+		min_depth = in_min_depth;
+		max_depth = in_max_depth;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_overdraw_buffer(
+			std::shared_ptr<resource<unsigned int>> in_overdraw_buffer)
+	{
+		overdraw_buffer = in_overdraw_buffer;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_visibility_buffer(
+			std::shared_ptr<resource<visibility_sample>> in_visibility_buffer)
+	{
+		visibility_buffer = in_visibility_buffer;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_shading_rate_image(
+			std::shared_ptr<resource<shading_rate>> in_shading_rate_image, size_t in_tile_size)
+	{
+		shading_rate_image = in_shading_rate_image;
+		shading_rate_tile = in_tile_size;
+		resize_coarse_buffers();
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::resize_coarse_buffers()
+	{
+		coarse_colors.resize(width * height);
+		coarse_stamps.assign(width * height, 0);
+		shading_stamp = 0;
+	}
+
+	template<typename VB, typename RT>
+	inline bool rasterizer<VB, RT>::get_coarse_anchor(size_t x, size_t y, size_t& anchor) const
+	{
+		if (!shading_rate_image) {
+			return false;
+		}
+		const shading_rate rate = shading_rate_image->item(x / shading_rate_tile, y / shading_rate_tile);
+		if (rate == shading_rate::rate_1x1) {
+			return false;
+		}
+		const uint2 block = get_shading_rate_size(rate);
+		anchor = (y - y % block.y) * width + (x - x % block.x);
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	inline size_t rasterizer<VB, RT>::get_primitive_id() const
+	{
+		return primitive_id;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::set_draw_constant(size_t value)
+	{
+		draw_constant = value;
+	}
+
+	template<typename VB, typename RT>
+	inline size_t rasterizer<VB, RT>::get_draw_constant() const
+	{
+		return draw_constant;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::execute(
+			const command_list<VB>& list, const std::function<void(size_t draw_index)>& after_draw)
+	{
+		using list_type = command_list<VB>;
+
+		size_t draw_index = 0;
+		for (const typename list_type::command& command: list.get_commands()) {
+			if (auto* vertex_command = std::get_if<typename list_type::set_vertex_buffer_command>(&command)) {
+				set_vertex_buffer(vertex_command->vertex_buffer);
 			}
+			else if (auto* index_command = std::get_if<typename list_type::set_index_buffer_command>(&command)) {
+				set_index_buffer(index_command->index_buffer);
+			}
+			else if (auto* constant_command = std::get_if<typename list_type::set_draw_constant_command>(&command)) {
+				set_draw_constant(constant_command->value);
+			}
+			else if (auto* draw_command = std::get_if<typename list_type::draw_command>(&command)) {
+				draw(draw_command->num_indices, draw_command->first_index);
+				if (after_draw) {
+					after_draw(draw_index);
+				}
+				++draw_index;
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline const rasterizer_statistics& rasterizer<VB, RT>::get_draw_statistics() const
+	{
+		return draw_statistics;
+	}
+
+	template<typename VB, typename RT>
+	inline const rasterizer_statistics& rasterizer<VB, RT>::get_frame_statistics() const
+	{
+		return frame_statistics;
+	}
 
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::reset_frame_statistics()
+	{
+		frame_statistics = rasterizer_statistics{};
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::draw(size_t num_indices, size_t first_index)
+	{
+		draw_statistics = rasterizer_statistics{};
+		draw_statistics.triangles_submitted = num_indices / 3;
+
+		for (size_t face_idx = 0; face_idx != num_indices / 3; ++face_idx) {
+			primitive_id = first_index / 3 + face_idx;
+
+			std::array<vertex, 3> face{};
 			std::array<float3, 3> vertices;
 			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_shader(face[i]);
+				face[i] = vertex_shader(vertex_buffer->item(fetch_index(first_index + 3 * face_idx + i)));
 				vertices[i] = float3(&face[i].position.x);
 			}
 
+			// There is no clipping, so triangles crossing the near or far plane are dropped
+			if (std::any_of(vertices.begin(), vertices.end(), [this](float3 v) { return v.z < min_depth || v.z > max_depth; })) {
+				++draw_statistics.triangles_culled_depth_range;
+				continue;
+			}
+
 			float ymin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
 			float ymax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
 
-			int yfrom = (std::clamp(static_cast<int>(std::ceil(ymin)), 0, static_cast<int>(height - 1)));
-			int yto = (std::clamp(static_cast<int>(std::ceil(ymax)), 0, static_cast<int>(height - 1)));
+			int yfrom = (std::clamp(static_cast<int>(std::ceil(ymin)), static_cast<int>(scissor_top), static_cast<int>(scissor_bottom)));
+			int yto = (std::clamp(static_cast<int>(std::ceil(ymax)), static_cast<int>(scissor_top), static_cast<int>(scissor_bottom)));
 
 			float xmin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
 			float xmax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
 
-			int xfrom = (std::clamp(static_cast<int>(std::ceil(xmin)), 0, static_cast<int>(width - 1)));
-			int xto = (std::clamp(static_cast<int>(std::ceil(xmax)), 0, static_cast<int>(width - 1)));
+			int xfrom = (std::clamp(static_cast<int>(std::ceil(xmin)), static_cast<int>(scissor_left), static_cast<int>(scissor_right)));
+			int xto = (std::clamp(static_cast<int>(std::ceil(xmax)), static_cast<int>(scissor_left), static_cast<int>(scissor_right)));
+
+			if (xmax <= static_cast<float>(scissor_left) || xmin >= static_cast<float>(scissor_right) ||
+				ymax <= static_cast<float>(scissor_top) || ymin >= static_cast<float>(scissor_bottom)) {
+				++draw_statistics.triangles_culled_off_screen;
+				continue;
+			}
+			if (xfrom >= xto || yfrom >= yto) {
+				++draw_statistics.triangles_culled_no_coverage;
+				continue;
+			}
 
 			float area_twice = (cross(vertices[1] - vertices[0], vertices[2] - vertices[0])).z;
+			if (area_twice == 0.0f) {
+				++draw_statistics.triangles_culled_degenerate;
+				continue;
+			}
+
+			++draw_statistics.triangles_rasterized;
+			++shading_stamp;
+
+			if (quad_pixel_shader) {
+				rasterize_quads(face, vertices, xfrom, xto, yfrom, yto);
+				continue;
+			}
 
 			for (int y = yfrom; y < yto; ++y) {
 				for (int x = xfrom; x < xto; ++x) {
@@ -151,12 +510,113 @@ namespace cg::renderer
 						continue;
 					}
 
+					++draw_statistics.pixels_tested;
 					if (depth_test(pixel_data.position.z, x, y)) {
 						float& depth = depth_buffer->item(x, y);
 						depth = pixel_data.position.z;
 
-						color pixel_value = pixel_shader(pixel_data, u * u + v * v + w * w, depth);
-						render_target->item(x, y) = unsigned_color::from_color(pixel_value);
+						++draw_statistics.depth_passes;
+						if (overdraw_buffer) {
+							++overdraw_buffer->item(x, y);
+						}
+						if (visibility_buffer) {
+							visibility_buffer->item(x, y) = {static_cast<uint32_t>(draw_constant), static_cast<uint32_t>(primitive_id)};
+						}
+
+						// Depth-only pass when no render target is bound
+						if (render_target) {
+							// Coarse blocks are shaded by their first covered pixel and broadcast to the rest
+							size_t anchor = 0;
+							const bool coarse = get_coarse_anchor(x, y, anchor);
+							if (coarse && coarse_stamps[anchor] == shading_stamp) {
+								++draw_statistics.pixels_broadcast;
+								render_target->item(x, y) = coarse_colors[anchor];
+								continue;
+							}
+
+							++draw_statistics.pixel_shader_invocations;
+							color pixel_value = pixel_shader(pixel_data, u * u + v * v + w * w, depth);
+							render_target->item(x, y) = unsigned_color::from_color(pixel_value);
+							if (coarse) {
+								coarse_stamps[anchor] = shading_stamp;
+								coarse_colors[anchor] = render_target->item(x, y);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		frame_statistics += draw_statistics;
+	}
+
+	template<typename VB, typename RT>
+	inline void rasterizer<VB, RT>::rasterize_quads(
+			const std::array<vertex, 3>& face, const std::array<float3, 3>& vertices,
+			int xfrom, int xto, int yfrom, int yto)
+	{
+		const float2 a{vertices[0].x, vertices[0].y};
+		const float2 b{vertices[1].x, vertices[1].y};
+		const float2 c{vertices[2].x, vertices[2].y};
+
+		const float area = edge_function(a, b, c);
+
+		for (int y = yfrom & ~1; y < yto; y += 2) {
+			for (int x = xfrom & ~1; x < xto; x += 2) {
+
+				pixel_quad<vertex> quad;
+				bool any_visible = false;
+				for (int lane = 0; lane != 4; ++lane) {
+					const int px = x + (lane & 1);
+					const int py = y + (lane >> 1);
+					const float2 p{static_cast<float>(px), static_cast<float>(py)};
+
+					// Helper lanes outside the triangle still get extrapolated attributes
+					const float u = edge_function(b, c, p) / area;
+					const float v = edge_function(c, a, p) / area;
+					const float w = 1.0f - u - v;
+
+					quad.data[lane] = face[0] * u + face[1] * v + face[2] * w;
+					quad.b[lane] = u * u + v * v + w * w;
+					quad.z[lane] = quad.data[lane].position.z;
+
+					const bool covered = u >= 0.0f && v >= 0.0f && w >= 0.0f &&
+										 px >= xfrom && px < xto && py >= yfrom && py < yto;
+					quad.mask[lane] = covered && depth_test(quad.z[lane], px, py);
+					any_visible |= quad.mask[lane];
+
+					draw_statistics.pixels_tested += covered ? 1 : 0;
+					draw_statistics.depth_passes += quad.mask[lane] ? 1 : 0;
+				}
+
+				if (!any_visible) {
+					continue;
+				}
+
+				quad.ddx = quad.data[1] + quad.data[0] * -1.0f;
+				quad.ddy = quad.data[2] + quad.data[0] * -1.0f;
+
+				std::array<color, 4> output{};
+				if (render_target) {
+					draw_statistics.pixel_shader_invocations += 4;
+					quad_pixel_shader(quad, output);
+				}
+
+				for (int lane = 0; lane != 4; ++lane) {
+					if (!quad.mask[lane]) {
+						continue;
+					}
+					const size_t px = static_cast<size_t>(x + (lane & 1));
+					const size_t py = static_cast<size_t>(y + (lane >> 1));
+					depth_buffer->item(px, py) = quad.z[lane];
+					if (overdraw_buffer) {
+						++overdraw_buffer->item(px, py);
+					}
+					if (visibility_buffer) {
+						visibility_buffer->item(px, py) = {static_cast<uint32_t>(draw_constant), static_cast<uint32_t>(primitive_id)};
+					}
+					if (render_target) {
+						render_target->item(px, py) = unsigned_color::from_color(output[lane]);
 					}
 				}
 			}
@@ -167,7 +627,7 @@ namespace cg::renderer
 	inline float
 	rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
 	{
-		THROW_ERROR("Not implemented yet");
+		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
 	}
 
 	template<typename VB, typename RT>
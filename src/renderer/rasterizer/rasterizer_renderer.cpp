@@ -1,18 +1,71 @@
 #include "rasterizer_renderer.h"
 
+#include "utils/halton.h"
+#include "utils/parallel.h"
 #include "utils/resource_utils.h"
 
 #include <DirectXMath.h>
+#include <thread>
 
 
+namespace
+{
+	// Transforms four points held one coordinate per vector, lane by lane, and divides by w like XMVector3TransformCoord
+	void transform_coord_lanes(const DirectX::XMFLOAT4X4& matrix, DirectX::XMVECTOR& x, DirectX::XMVECTOR& y, DirectX::XMVECTOR& z)
+	{
+		using namespace DirectX;
+
+		const auto column = [&](size_t j) {
+			XMVECTOR result = XMVectorReplicate(matrix.m[3][j]);
+			result = XMVectorMultiplyAdd(z, XMVectorReplicate(matrix.m[2][j]), result);
+			result = XMVectorMultiplyAdd(y, XMVectorReplicate(matrix.m[1][j]), result);
+			return XMVectorMultiplyAdd(x, XMVectorReplicate(matrix.m[0][j]), result);
+		};
+		const XMVECTOR inverse_w = XMVectorReciprocal(column(3));
+		const XMVECTOR result_x = XMVectorMultiply(column(0), inverse_w);
+		const XMVECTOR result_y = XMVectorMultiply(column(1), inverse_w);
+		z = XMVectorMultiply(column(2), inverse_w);
+		x = result_x;
+		y = result_y;
+	}
+}// namespace
+
 void cg::renderer::rasterization_renderer::init()
 {
-	render_target = std::make_shared<resource<unsigned_color>>(get_width(), get_height());
-	depth_buffer = std::make_shared<resource<float>>(get_width(), get_height());
+	render_target = std::make_shared<resource<unsigned_color>>(get_render_width(), get_render_height());
+	depth_buffer = std::make_shared<resource<float>>(get_render_width(), get_render_height());
 
-	rasterizer = std::make_shared<cg::renderer::rasterizer<vertex, unsigned_color>>();
+	rasterizer = std::make_shared<cg::renderer::rasterizer<compact_vertex, unsigned_color>>();
 	rasterizer->set_render_target(render_target, depth_buffer);
-	rasterizer->set_viewport(get_width(), get_height());
+	rasterizer->set_viewport(get_render_width(), get_render_height());
+
+	if (settings->taa && settings->accumulation_num > 1) {
+		history = std::make_shared<resource<DirectX::XMFLOAT3>>(get_render_width(), get_render_height());
+		resolved = std::make_shared<resource<DirectX::XMFLOAT3>>(get_render_width(), get_render_height());
+	}
+
+	damaged_tiles.assign(((get_render_width() + damage_tile - 1) / damage_tile) * ((get_render_height() + damage_tile - 1) / damage_tile), false);
+	full_redraw = true;
+
+	if (settings->shading_rate_mode != "off") {
+		shading_rate_image = std::make_shared<resource<shading_rate>>(
+				(get_render_width() + shading_rate_tile - 1) / shading_rate_tile,
+				(get_render_height() + shading_rate_tile - 1) / shading_rate_tile);
+		rasterizer->set_shading_rate_image(shading_rate_image, shading_rate_tile);
+	}
+
+	if (settings->debug_overdraw) {
+		overdraw_buffer = std::make_shared<resource<unsigned int>>(get_render_width(), get_render_height());
+		rasterizer->set_overdraw_buffer(overdraw_buffer);
+	}
+
+	if (settings->ssr) {
+		visibility_buffer = std::make_shared<resource<visibility_sample>>(get_render_width(), get_render_height());
+		reflection_source = std::make_shared<resource<unsigned_color>>(get_render_width(), get_render_height());
+		rasterizer->set_visibility_buffer(visibility_buffer);
+		ssr.set_resolution(get_render_width(), get_render_height());
+		ssr.set_depth_range(settings->camera_z_near, settings->camera_z_far);
+	}
 
 	const DirectX::XMFLOAT3 camera_position{
 			settings->camera_position[0],
@@ -31,8 +84,164 @@ void cg::renderer::rasterization_renderer::init()
 
 	model = std::make_shared<cg::world::model>();
 	model->load_obj(settings->model_path);
+	build_draw_clusters();
+	build_face_normals();
+
+	const DirectX::XMFLOAT3 light_position{
+			settings->light_position[0],
+			settings->light_position[1],
+			settings->light_position[2]};
+
+	light_camera = std::make_shared<cg::world::camera>();
+	light_camera->set_position(DirectX::XMLoadFloat3(&light_position));
+	light_camera->set_angle_of_view(120.0f);
+	light_camera->set_height(static_cast<float>(settings->shadow_map_resolution));
+	light_camera->set_width(static_cast<float>(settings->shadow_map_resolution));
+	light_camera->set_theta(0.0f);
+	light_camera->set_phi(-89.0f);
+	light_camera->set_z_near(0.01f);
+	light_camera->set_z_far(settings->camera_z_far);
+
+	shadow_map = std::make_shared<resource<float>>(settings->shadow_map_resolution, settings->shadow_map_resolution);
+
+	// The shadow casting key light always comes first in the light list
+	model->add_light({light_position, {1.0f, 1.0f, 1.0f}, settings->camera_z_far});
+	model->add_random_lights(settings->num_random_lights, settings->random_light_range);
+
+	light_grid.set_grid(get_render_width(), get_render_height(), 32, 24);
+
+	if (settings->ssao) {
+		ssao.set_resolution(get_render_width(), get_render_height(), settings->ssao_resolution_divider);
+		ssao.set_radius(settings->ssao_radius);
+	}
+
+	shadow_rasterizer = std::make_shared<cg::renderer::rasterizer<compact_vertex, unsigned_color>>();
+	shadow_rasterizer->set_render_target(nullptr, shadow_map);
+	shadow_rasterizer->set_viewport(settings->shadow_map_resolution, settings->shadow_map_resolution);
+	shadow_rasterizer->set_depth_range(0.0f, 1.0f);
+
+	shadow_rasterizer->vertex_shader = [this](const compact_vertex& compact_data) {
+		vertex vertex_data = compact_data.decode(model->get_vertex_quantizations()[shadow_rasterizer->get_draw_constant()]);
+
+		const DirectX::XMMATRIX world = (model->get_world_matrix());
+		const DirectX::XMMATRIX view = (light_camera->get_view_matrix());
+		const DirectX::XMMATRIX projection = (light_camera->get_projection_matrix());
+
+		DirectX::XMVECTOR address = DirectX::XMLoadFloat3(&vertex_data.position);
+
+		address = DirectX::XMVector3Project(address, 0.0f, 0.0f,
+											static_cast<float>(settings->shadow_map_resolution),
+											static_cast<float>(settings->shadow_map_resolution),
+											0.0f, 1.0f,
+											projection, view, world);
+
+		DirectX::XMStoreFloat3(&vertex_data.position, address);
+		return vertex_data;
+	};
+
+	setup_main_pass(*rasterizer);
+
+	// Sort-last workers each own a full colour and depth target and draw a share of the clusters
+	const unsigned int num_workers = settings->sort_last_workers > 1 ? settings->sort_last_workers : 0;
+	workers.clear();
+	for (unsigned int i = 0; i != num_workers; ++i) {
+		auto worker = std::make_unique<sort_last_worker>();
+		worker->render_target = std::make_shared<resource<unsigned_color>>(get_render_width(), get_render_height());
+		worker->depth_buffer = std::make_shared<resource<float>>(get_render_width(), get_render_height());
+		worker->rasterizer = std::make_shared<cg::renderer::rasterizer<compact_vertex, unsigned_color>>();
+		worker->rasterizer->set_render_target(worker->render_target, worker->depth_buffer);
+		worker->rasterizer->set_viewport(get_render_width(), get_render_height());
+		if (shading_rate_image) {
+			worker->rasterizer->set_shading_rate_image(shading_rate_image, shading_rate_tile);
+		}
+		if (visibility_buffer) {
+			worker->visibility_buffer = std::make_shared<resource<visibility_sample>>(get_render_width(), get_render_height());
+			worker->rasterizer->set_visibility_buffer(worker->visibility_buffer);
+		}
+		setup_main_pass(*worker->rasterizer);
+		workers.push_back(std::move(worker));
+	}
+}
+
+void cg::renderer::rasterization_renderer::destroy() {}
+
+void cg::renderer::rasterization_renderer::update()
+{
+	if (settings->animated_shape >= model->get_vertex_buffers().size()) {
+		THROW_ERROR("animated_shape is out of range");
+	}
+	model->rotate_shape(settings->animated_shape, DirectX::XMConvertToRadians(settings->animation_angle));
+	invalidate_shape(settings->animated_shape);
+}
+
+void cg::renderer::rasterization_renderer::render()
+{
+	auto& vertex_buffers = model->get_vertex_buffers();
+	auto& index_buffers = model->get_index_buffers();
+
+	const size_t num_shapes = vertex_buffers.size();
+
+	shadow_rasterizer->reset_frame_statistics();
+	shadow_rasterizer->clear_render_target(FLT_MAX);
+	for (size_t i = 0; i != num_shapes; ++i) {
+		shadow_rasterizer->set_draw_constant(i);
+		shadow_rasterizer->set_vertex_buffer(vertex_buffers[i]);
+		shadow_rasterizer->set_index_buffer(index_buffers[i]);
+
+		shadow_rasterizer->draw(index_buffers[i].get_number_of_elements());
+	}
+
+	const size_t num_frames = history ? settings->accumulation_num : 1;
+	for (size_t frame_id = 0; frame_id != num_frames; ++frame_id) {
+		if (num_frames > 1) {
+			std::cerr << "Rendering frame " << frame_id << "...\r" << std::flush;
+		}
+		render_frame(frame_id);
+	}
+
+	if (settings->debug_overdraw) {
+		std::cout << "Shadow pass: " << shadow_rasterizer->get_frame_statistics() << std::endl;
+		if (workers.empty()) {
+			std::cout << "Main pass: " << rasterizer->get_frame_statistics() << std::endl;
+		}
+		for (size_t i = 0; i != workers.size(); ++i) {
+			std::cout << "Worker " << i << ": " << workers[i]->rasterizer->get_frame_statistics() << std::endl;
+		}
+
+		if (settings->front_to_back && workers.empty()) {
+			const size_t unsorted = measure_unsorted_depth_passes();
+			const size_t sorted = rasterizer->get_frame_statistics().depth_passes;
+			const size_t saved = unsorted > sorted ? unsorted - sorted : 0;
+			std::cout << "Front-to-back order saved " << saved << " of " << unsorted << " depth passes ("
+					  << (unsorted ? 100.0 * static_cast<double>(saved) / static_cast<double>(unsorted) : 0.0) << "%)" << std::endl;
+		}
+
+		if (workers.empty()) {
+			utils::save_heatmap(*overdraw_buffer, utils::get_debug_path(settings->result_path, "overdraw"));
+		}
+	}
+
+	// The shadow map stays as rendered above, the animated shape keeps its first shadow
+	for (size_t step = 0; step != settings->animation_frames; ++step) {
+		std::cerr << "Rendering animation frame " << step << "...\r" << std::flush;
+		const size_t frame_id = num_frames + step;
+		update();
+		render_frame(frame_id);
+		if (settings->debug_incremental) {
+			check_incremental_frame(frame_id);
+		}
+	}
+	save_result(*render_target);
+}
+
+void cg::renderer::rasterization_renderer::setup_main_pass(
+		cg::renderer::rasterizer<compact_vertex, unsigned_color>& target)
+{
+	target.set_depth_range(settings->camera_z_near, settings->camera_z_far);
+
+	target.vertex_shader = [this, &target](const compact_vertex& compact_data) {
+		vertex vertex_data = compact_data.decode(model->get_vertex_quantizations()[target.get_draw_constant()]);
 
-	rasterizer->vertex_shader = [this](vertex vertex_data) {
 		const DirectX::XMMATRIX world = (model->get_world_matrix());
 		const DirectX::XMMATRIX view = (camera->get_view_matrix());
 		const DirectX::XMMATRIX projection = (camera->get_projection_matrix());
@@ -40,41 +249,982 @@ void cg::renderer::rasterization_renderer::init()
 		DirectX::XMVECTOR address = DirectX::XMLoadFloat3(&vertex_data.position);
 
 		address = DirectX::XMVector3Project(address, 0.0f, 0.0f,
-											static_cast<float>(settings->width),
-											static_cast<float>(settings->height),
+											static_cast<float>(get_render_width()),
+											static_cast<float>(get_render_height()),
 											settings->camera_z_near,
 											settings->camera_z_far,
 											projection, view, world);
+		address = DirectX::XMVectorAdd(address, DirectX::XMVectorSet(frame.jitter.x, frame.jitter.y, 0.0f, 0.0f));
 
 		DirectX::XMStoreFloat3(&vertex_data.position, address);
 		return vertex_data;
 	};
 
-	rasterizer->pixel_shader = [this](vertex vertex_data, const float b, const float z) {
-		const float distance = 0.25f + 0.75f * 5000 * z;
-		const float intensity = (1 - b);
-		return color::from_float3(float3{intensity, intensity, intensity});
+	target.pixel_shader = [this, &target](const vertex& vertex_data, const float /*b*/, const float /*z*/) {
+		using namespace DirectX;
+
+		const size_t primitive_id = target.get_primitive_id();
+		const uint16_t material_id = model->get_material_id_buffers()[target.get_draw_constant()]->item(primitive_id);
+		const material& surface = model->get_materials()[material_id];
+
+		const XMVECTOR position = reconstruct_world_position(vertex_data.position);
+		const XMVECTOR eye_offset = XMVectorSubtract(position, XMLoadFloat3(&frame.eye));
+		const float view_depth = XMVectorGetX(XMVector3Dot(eye_offset, XMLoadFloat3(&frame.direction)));
+
+		// Lighting is two-sided, so the face normal is flipped towards the viewer
+		XMVECTOR normal = XMLoadFloat3(&face_normals[target.get_draw_constant()]->item(primitive_id));
+		if (XMVectorGetX(XMVector3Dot(normal, eye_offset)) > 0.0f) {
+			normal = XMVectorNegate(normal);
+		}
+
+		constexpr float ambient_intensity = 0.1f;
+		XMVECTOR output = XMVectorAdd(XMLoadFloat3(&surface.emissive), XMVectorScale(XMLoadFloat3(&surface.ambient), ambient_intensity));
+
+		const size_t x = static_cast<size_t>(std::max(vertex_data.position.x, 0.0f));
+		const size_t y = static_cast<size_t>(std::max(vertex_data.position.y, 0.0f));
+		const light_clusters::cluster_range cluster = light_grid.get_cluster(x, y, view_depth);
+		for (unsigned int i = 0; i != cluster.count; ++i) {
+			const unsigned int light_id = light_grid.get_light_index(cluster.offset + i);
+			XMVECTOR contribution = shade_point_light(model->get_lights()[light_id], surface, position, normal);
+			if (light_id == 0) {
+				contribution = XMVectorScale(contribution, sample_shadow(position));
+			}
+			output = XMVectorAdd(output, contribution);
+		}
+
+		XMFLOAT3 result;
+		XMStoreFloat3(&result, output);
+		return color::from_XMFLOAT3(result);
 	};
+
+	if (settings->quad_shading) {
+		target.quad_pixel_shader = [this, &target](const pixel_quad<vertex>& quad, std::array<color, 4>& output) {
+			shade_quad(target, quad, output);
+		};
+	}
 }
 
-void cg::renderer::rasterization_renderer::destroy() {}
+void cg::renderer::rasterization_renderer::render_frame(size_t frame_id)
+{
+	update_frame_constants(frame_id);
+	light_grid.build(model->get_lights(), *camera);
+	if (shading_rate_image) {
+		update_shading_rate_image(frame_id);
+	}
 
-void cg::renderer::rasterization_renderer::update() {}
+	last_frame_incremental = can_render_incrementally();
+	if (last_frame_incremental) {
+		render_damaged_tiles();
+	}
+	else if (!workers.empty()) {
+		render_sort_last();
+	}
+	else {
+		render_clusters();
+	}
 
-void cg::renderer::rasterization_renderer::render()
+	if (settings->ssao) {
+		apply_ambient_occlusion();
+	}
+	if (settings->ssr) {
+		apply_reflections();
+	}
+	if (history) {
+		resolve_temporal(frame_id);
+	}
+
+	full_redraw = false;
+	std::fill(damaged_tiles.begin(), damaged_tiles.end(), false);
+	presented_view_projection = frame.view_projection;
+}
+
+void cg::renderer::rasterization_renderer::invalidate_bounds(const DirectX::BoundingBox& world_bounds)
 {
+	std::array<size_t, 4> rect;
+	if (!get_screen_rect(world_bounds, rect)) {
+		return;
+	}
+
+	const size_t tiles_x = (get_render_width() + damage_tile - 1) / damage_tile;
+	for (size_t tile_y = rect[1] / damage_tile; tile_y * damage_tile < rect[3]; ++tile_y) {
+		for (size_t tile_x = rect[0] / damage_tile; tile_x * damage_tile < rect[2]; ++tile_x) {
+			damaged_tiles[tile_y * tiles_x + tile_x] = true;
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::invalidate_shape(size_t shape)
+{
+	for (draw_cluster& cluster: draw_clusters) {
+		if (cluster.shape != shape) {
+			continue;
+		}
+		invalidate_bounds(cluster.bounds);
+		compute_cluster_bounds(cluster);
+		invalidate_bounds(cluster.bounds);
+	}
+	face_normals[shape] = compute_face_normals(shape);
+}
+
+void cg::renderer::rasterization_renderer::invalidate_material(size_t material_id)
+{
+	for (const draw_cluster& cluster: draw_clusters) {
+		auto& material_ids = model->get_material_id_buffers()[cluster.shape];
+		const size_t first_face = cluster.first_index / 3;
+		for (size_t face = first_face; face != first_face + cluster.num_indices / 3; ++face) {
+			if (material_ids->item(face) == material_id) {
+				invalidate_bounds(cluster.bounds);
+				break;
+			}
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::invalidate_all()
+{
+	full_redraw = true;
+}
+
+bool cg::renderer::rasterization_renderer::get_screen_rect(const DirectX::BoundingBox& world_bounds, std::array<size_t, 4>& rect) const
+{
+	using namespace DirectX;
+
+	const float width = static_cast<float>(get_render_width());
+	const float height = static_cast<float>(get_render_height());
+	const XMMATRIX view = camera->get_view_matrix();
+	const XMMATRIX view_projection = XMMatrixMultiply(view, camera->get_projection_matrix());
+
+	std::array<XMFLOAT3, BoundingBox::CORNER_COUNT> corners;
+	world_bounds.GetCorners(corners.data());
+
+	float left = FLT_MAX, top = FLT_MAX, right = -FLT_MAX, bottom = -FLT_MAX;
+	for (const XMFLOAT3& corner: corners) {
+		const XMVECTOR position = XMLoadFloat3(&corner);
+		// Boxes reaching behind the eye cannot be projected and may cover anything
+		if (XMVectorGetZ(XMVector3Transform(position, view)) < settings->camera_z_near) {
+			rect = {0, 0, get_render_width(), get_render_height()};
+			return true;
+		}
+		const XMVECTOR clip = XMVector3TransformCoord(position, view_projection);
+		const float x = (XMVectorGetX(clip) * 0.5f + 0.5f) * width;
+		const float y = (0.5f - XMVectorGetY(clip) * 0.5f) * height;
+		left = std::min(left, x);
+		right = std::max(right, x);
+		top = std::min(top, y);
+		bottom = std::max(bottom, y);
+	}
+
+	if (right < 0.0f || bottom < 0.0f || left >= width || top >= height) {
+		return false;
+	}
+	// One pixel of slack for the rasterizer's rounding
+	rect = {static_cast<size_t>(std::max(left - 1.0f, 0.0f)),
+			static_cast<size_t>(std::max(top - 1.0f, 0.0f)),
+			static_cast<size_t>(std::min(right + 2.0f, width)),
+			static_cast<size_t>(std::min(bottom + 2.0f, height))};
+	return true;
+}
+
+bool cg::renderer::rasterization_renderer::can_render_incrementally() const
+{
+	if (full_redraw || history || settings->ssao || settings->ssr || !workers.empty() || settings->shading_rate_mode == "contrast") {
+		return false;
+	}
+	const float* previous = &presented_view_projection._11;
+	const float* current = &frame.view_projection._11;
+	return std::equal(previous, previous + 16, current);
+}
+
+void cg::renderer::rasterization_renderer::render_damaged_tiles()
+{
+	const size_t tiles_x = (get_render_width() + damage_tile - 1) / damage_tile;
+	const size_t tiles_y = (get_render_height() + damage_tile - 1) / damage_tile;
+
+	const std::vector<size_t> order = get_draw_order();
+	std::vector<std::array<size_t, 4>> cluster_rects(draw_clusters.size());
+	std::vector<bool> on_screen(draw_clusters.size());
+	for (size_t i = 0; i != draw_clusters.size(); ++i) {
+		on_screen[i] = get_screen_rect(draw_clusters[i].bounds, cluster_rects[i]);
+	}
+
+	rasterizer->reset_frame_statistics();
+
+	// Runs of damaged tiles along each tile row are redrawn as one scissored rectangle
+	for (size_t tile_y = 0; tile_y != tiles_y; ++tile_y) {
+		size_t tile_x = 0;
+		while (tile_x != tiles_x) {
+			if (!damaged_tiles[tile_y * tiles_x + tile_x]) {
+				++tile_x;
+				continue;
+			}
+			const size_t run_begin = tile_x;
+			while (tile_x != tiles_x && damaged_tiles[tile_y * tiles_x + tile_x]) {
+				++tile_x;
+			}
+
+			const std::array<size_t, 4> rect{run_begin * damage_tile, tile_y * damage_tile,
+											 std::min(tile_x * damage_tile, static_cast<size_t>(get_render_width())),
+											 std::min((tile_y + 1) * damage_tile, static_cast<size_t>(get_render_height()))};
+			rasterizer->set_scissor(rect[0], rect[1], rect[2], rect[3]);
+			rasterizer->clear_render_target(FLT_MAX);
+
+			for (size_t cluster_idx: order) {
+				const std::array<size_t, 4>& bounds = cluster_rects[cluster_idx];
+				if (!on_screen[cluster_idx] || bounds[2] <= rect[0] || bounds[0] >= rect[2] || bounds[3] <= rect[1] || bounds[1] >= rect[3]) {
+					continue;
+				}
+				const draw_cluster& cluster = draw_clusters[cluster_idx];
+				rasterizer->set_draw_constant(cluster.shape);
+				rasterizer->set_vertex_buffer(model->get_vertex_buffers()[cluster.shape]);
+				rasterizer->set_index_buffer(model->get_index_buffers()[cluster.shape]);
+				rasterizer->draw(cluster.num_indices, cluster.first_index);
+			}
+		}
+	}
+
+	rasterizer->set_scissor(0, 0, get_render_width(), get_render_height());
+}
+
+void cg::renderer::rasterization_renderer::check_incremental_frame(size_t frame_id)
+{
+	if (!last_frame_incremental) {
+		return;
+	}
+	const resource<unsigned_color> incremental = *render_target;
+
+	invalidate_all();
+	render_frame(frame_id);
+
+	size_t num_different = 0;
+	for (size_t i = 0; i != render_target->get_number_of_elements(); ++i) {
+		const unsigned_color& a = incremental.item(i);
+		const unsigned_color& b = render_target->item(i);
+		if (a.r != b.r || a.g != b.g || a.b != b.b) {
+			++num_different;
+		}
+	}
+	if (num_different != 0) {
+		THROW_ERROR("Frame " + std::to_string(frame_id) + " redrawn from damaged tiles differs from a full render in " + std::to_string(num_different) + " pixels");
+	}
+}
+
+void cg::renderer::rasterization_renderer::render_clusters()
+{
+	const std::vector<size_t> order = get_draw_order();
+
+	// Culling and recording are split into separate lists for the worker threads, submission stays in draw order.
+	// Small scenes get a single list, which parallel_for_tiles records on the calling thread.
+	constexpr size_t min_clusters_per_list = 256;
+	const size_t num_lists = std::clamp<size_t>(order.size() / min_clusters_per_list, 1, std::max(std::thread::hardware_concurrency(), 1u));
+	const size_t chunk_size = (order.size() + num_lists - 1) / num_lists;
+	command_lists.resize(num_lists);
+	recorded_clusters.resize(num_lists);
+
+	utils::parallel_for_tiles(num_lists, 1, 1, [this, &order, chunk_size](size_t list_begin, size_t, size_t list_end, size_t) {
+		for (size_t i = list_begin; i != list_end; ++i) {
+			const size_t begin = std::min(i * chunk_size, order.size());
+			const size_t end = std::min(begin + chunk_size, order.size());
+			record_clusters(command_lists[i], recorded_clusters[i], order.begin() + begin, order.begin() + end);
+		}
+	});
+
+	rasterizer->reset_frame_statistics();
 	rasterizer->clear_render_target(FLT_MAX);
 
-	auto& vertex_buffers = model->get_vertex_buffers();
-	auto& index_buffers = model->get_index_buffers();
+	for (size_t i = 0; i != num_lists; ++i) {
+		if (!settings->debug_overdraw) {
+			rasterizer->execute(command_lists[i]);
+			continue;
+		}
+		rasterizer->execute(command_lists[i], [this, i](size_t draw_index) {
+			const size_t cluster_idx = recorded_clusters[i][draw_index];
+			std::cout << "Draw " << cluster_idx << " (shape " << draw_clusters[cluster_idx].shape << "): " << rasterizer->get_draw_statistics() << std::endl;
+		});
+	}
+}
 
-	const size_t num_shapes = vertex_buffers.size();
+void cg::renderer::rasterization_renderer::record_clusters(
+		command_list<compact_vertex>& list, std::vector<size_t>& clusters,
+		std::vector<size_t>::const_iterator begin, std::vector<size_t>::const_iterator end) const
+{
+	list.reset();
+	clusters.clear();
 
-	for (size_t i = 0; i != num_shapes; ++i) {
-		rasterizer->set_vertex_buffer(vertex_buffers[i]);
-		rasterizer->set_index_buffer(index_buffers[i]);
+	size_t bound_shape = SIZE_MAX;
+	for (auto it = begin; it != end; ++it) {
+		const draw_cluster& cluster = draw_clusters[*it];
+		if (!is_cluster_visible(cluster)) {
+			continue;
+		}
+		if (cluster.shape != bound_shape) {
+			bound_shape = cluster.shape;
+			list.set_draw_constant(cluster.shape);
+			list.set_vertex_buffer(model->get_vertex_buffers()[cluster.shape]);
+			list.set_index_buffer(model->get_index_buffers()[cluster.shape]);
+		}
+		list.draw(cluster.num_indices, cluster.first_index);
+		clusters.push_back(*it);
+	}
+}
+
+bool cg::renderer::rasterization_renderer::is_cluster_visible(const draw_cluster& cluster) const
+{
+	return frame.view_frustum.Intersects(cluster.bounds);
+}
+
+void cg::renderer::rasterization_renderer::render_sort_last()
+{
+	// Greedy balance by index count; every worker still receives its clusters front to back
+	std::vector<size_t> loads(workers.size(), 0);
+	for (auto& worker: workers) {
+		worker->clusters.clear();
+	}
+	for (size_t cluster_idx: get_draw_order()) {
+		if (!is_cluster_visible(draw_clusters[cluster_idx])) {
+			continue;
+		}
+		const size_t target = std::min_element(loads.begin(), loads.end()) - loads.begin();
+		workers[target]->clusters.push_back(cluster_idx);
+		loads[target] += draw_clusters[cluster_idx].num_indices;
+	}
+
+	std::vector<std::thread> threads;
+	threads.reserve(workers.size());
+	for (auto& worker: workers) {
+		threads.emplace_back([this, &worker]() {
+			worker->rasterizer->reset_frame_statistics();
+			worker->rasterizer->clear_render_target(FLT_MAX);
+			for (size_t cluster_idx: worker->clusters) {
+				const draw_cluster& cluster = draw_clusters[cluster_idx];
+				worker->rasterizer->set_draw_constant(cluster.shape);
+				worker->rasterizer->set_vertex_buffer(model->get_vertex_buffers()[cluster.shape]);
+				worker->rasterizer->set_index_buffer(model->get_index_buffers()[cluster.shape]);
+				worker->rasterizer->draw(cluster.num_indices, cluster.first_index);
+			}
+		});
+	}
+	for (std::thread& thread: threads) {
+		thread.join();
+	}
+
+	composite_workers();
+}
+
+void cg::renderer::rasterization_renderer::composite_workers()
+{
+	using namespace DirectX;
+
+	// Each output pixel takes the colour of the worker with the closest depth, four pixels at a time
+	utils::parallel_for_tiles(get_render_width(), get_render_height(), 64, [this](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			size_t x = x_begin;
+			for (; x + 4 <= x_end; x += 4) {
+				XMVECTOR closest_depth = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&workers[0]->depth_buffer->item(x, y)));
+				XMVECTOR closest_worker = XMVectorZero();
+				for (size_t i = 1; i != workers.size(); ++i) {
+					const XMVECTOR depth = XMLoadFloat4(reinterpret_cast<const XMFLOAT4*>(&workers[i]->depth_buffer->item(x, y)));
+					const XMVECTOR closer = XMVectorLess(depth, closest_depth);
+					closest_depth = XMVectorSelect(closest_depth, depth, closer);
+					closest_worker = XMVectorSelect(closest_worker, XMVectorReplicate(static_cast<float>(i)), closer);
+				}
+
+				XMFLOAT4 winners;
+				XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(&depth_buffer->item(x, y)), closest_depth);
+				XMStoreFloat4(&winners, closest_worker);
+				for (size_t lane = 0; lane != 4; ++lane) {
+					const size_t winner = static_cast<size_t>((&winners.x)[lane]);
+					render_target->item(x + lane, y) = workers[winner]->render_target->item(x + lane, y);
+					if (visibility_buffer) {
+						visibility_buffer->item(x + lane, y) = workers[winner]->visibility_buffer->item(x + lane, y);
+					}
+				}
+			}
+
+			for (; x != x_end; ++x) {
+				size_t winner = 0;
+				for (size_t i = 1; i != workers.size(); ++i) {
+					if (workers[i]->depth_buffer->item(x, y) < workers[winner]->depth_buffer->item(x, y)) {
+						winner = i;
+					}
+				}
+				depth_buffer->item(x, y) = workers[winner]->depth_buffer->item(x, y);
+				render_target->item(x, y) = workers[winner]->render_target->item(x, y);
+				if (visibility_buffer) {
+					visibility_buffer->item(x, y) = workers[winner]->visibility_buffer->item(x, y);
+				}
+			}
+		}
+	});
+}
+
+void cg::renderer::rasterization_renderer::update_shading_rate_image(size_t frame_id)
+{
+	const size_t tiles_x = shading_rate_image->get_stride();
+	const size_t tiles_y = shading_rate_image->get_number_of_elements() / tiles_x;
+	const float half_width = 0.5f * static_cast<float>(get_render_width());
+	const float half_height = 0.5f * static_cast<float>(get_render_height());
+
+	for (size_t tile_y = 0; tile_y != tiles_y; ++tile_y) {
+		for (size_t tile_x = 0; tile_x != tiles_x; ++tile_x) {
+			shading_rate rate = shading_rate::rate_1x1;
+
+			if (settings->shading_rate_mode == "periphery") {
+				const float dx = ((static_cast<float>(tile_x) + 0.5f) * shading_rate_tile - half_width) / half_width;
+				const float dy = ((static_cast<float>(tile_y) + 0.5f) * shading_rate_tile - half_height) / half_height;
+				const float radius = std::sqrt(dx * dx + dy * dy);
+				if (radius > 1.1f) {
+					rate = shading_rate::rate_4x4;
+				}
+				else if (radius > 0.8f) {
+					rate = shading_rate::rate_2x2;
+				}
+				else if (radius > 0.5f) {
+					rate = shading_rate::rate_1x2;
+				}
+			}
+			// The render target still holds the previous frame, flat tiles there get coarser rates
+			else if (settings->shading_rate_mode == "contrast" && frame_id > 0) {
+				float min_luma = FLT_MAX;
+				float max_luma = -FLT_MAX;
+				const size_t x_end = std::min((tile_x + 1) * shading_rate_tile, static_cast<size_t>(get_render_width()));
+				const size_t y_end = std::min((tile_y + 1) * shading_rate_tile, static_cast<size_t>(get_render_height()));
+				for (size_t y = tile_y * shading_rate_tile; y != y_end; ++y) {
+					for (size_t x = tile_x * shading_rate_tile; x != x_end; ++x) {
+						const float3 pixel = render_target->item(x, y).to_float3();
+						const float luma = 0.299f * pixel.x + 0.587f * pixel.y + 0.114f * pixel.z;
+						min_luma = std::min(min_luma, luma);
+						max_luma = std::max(max_luma, luma);
+					}
+				}
+				const float contrast = max_luma - min_luma;
+				if (contrast < 0.02f) {
+					rate = shading_rate::rate_4x4;
+				}
+				else if (contrast < 0.05f) {
+					rate = shading_rate::rate_2x2;
+				}
+				else if (contrast < 0.1f) {
+					rate = shading_rate::rate_1x2;
+				}
+			}
+
+			shading_rate_image->item(tile_x, tile_y) = rate;
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::build_draw_clusters()
+{
+	const size_t cluster_indices = 3 * static_cast<size_t>(settings->draw_cluster_size);
+
+	draw_clusters.clear();
+	for (size_t shape = 0; shape != model->get_vertex_buffers().size(); ++shape) {
+		const size_t num_indices = model->get_index_buffers()[shape].get_number_of_elements();
+		const size_t step = cluster_indices ? cluster_indices : num_indices;
+		for (size_t first = 0; first < num_indices; first += step) {
+			const size_t count = std::min(step, num_indices - first);
+			draw_cluster cluster{shape, first, count, {}};
+			compute_cluster_bounds(cluster);
+			draw_clusters.push_back(cluster);
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::compute_cluster_bounds(draw_cluster& cluster) const
+{
+	auto& vertex_buffer = model->get_vertex_buffers()[cluster.shape];
+	const compact_index_buffer& index_buffer = model->get_index_buffers()[cluster.shape];
+	const vertex_quantization& quantization = model->get_vertex_quantizations()[cluster.shape];
+
+	std::vector<DirectX::XMFLOAT3> positions(cluster.num_indices);
+	for (size_t i = 0; i != cluster.num_indices; ++i) {
+		positions[i] = vertex_buffer->item(index_buffer.item(cluster.first_index + i)).decode(quantization).position;
+	}
+	DirectX::BoundingBox::CreateFromPoints(cluster.bounds, positions.size(), positions.data(), sizeof(DirectX::XMFLOAT3));
+}
+
+std::vector<size_t> cg::renderer::rasterization_renderer::get_draw_order() const
+{
+	std::vector<size_t> order(draw_clusters.size());
+	for (size_t i = 0; i != order.size(); ++i) {
+		order[i] = i;
+	}
+	if (!settings->front_to_back) {
+		return order;
+	}
+
+	// Distance from the eye to the closest point of each cluster's box
+	const DirectX::XMVECTOR eye = camera->get_position();
+	std::vector<float> distances(draw_clusters.size());
+	for (size_t i = 0; i != draw_clusters.size(); ++i) {
+		const DirectX::XMVECTOR center = DirectX::XMLoadFloat3(&draw_clusters[i].bounds.Center);
+		const DirectX::XMVECTOR extents = DirectX::XMLoadFloat3(&draw_clusters[i].bounds.Extents);
+		const DirectX::XMVECTOR closest = DirectX::XMVectorClamp(eye, DirectX::XMVectorSubtract(center, extents), DirectX::XMVectorAdd(center, extents));
+		distances[i] = DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(DirectX::XMVectorSubtract(eye, closest)));
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&distances](size_t a, size_t b) { return distances[a] < distances[b]; });
+	return order;
+}
+
+size_t cg::renderer::rasterization_renderer::measure_unsorted_depth_passes()
+{
+	auto reference_depth = std::make_shared<resource<float>>(get_render_width(), get_render_height());
+
+	cg::renderer::rasterizer<compact_vertex, unsigned_color> reference;
+	reference.set_render_target(nullptr, reference_depth);
+	reference.set_viewport(get_render_width(), get_render_height());
+	setup_main_pass(reference);
+	reference.clear_render_target(FLT_MAX);
+
+	// Culled the same way as the main pass, so only the draw order differs
+	for (const draw_cluster& cluster: draw_clusters) {
+		if (!is_cluster_visible(cluster)) {
+			continue;
+		}
+		reference.set_draw_constant(cluster.shape);
+		reference.set_vertex_buffer(model->get_vertex_buffers()[cluster.shape]);
+		reference.set_index_buffer(model->get_index_buffers()[cluster.shape]);
+		reference.draw(cluster.num_indices, cluster.first_index);
+	}
+
+	return reference.get_frame_statistics().depth_passes;
+}
+
+void cg::renderer::rasterization_renderer::build_face_normals()
+{
+	face_normals.clear();
+	for (size_t shape = 0; shape != model->get_vertex_buffers().size(); ++shape) {
+		face_normals.push_back(compute_face_normals(shape));
+	}
+}
+
+std::shared_ptr<cg::resource<DirectX::XMFLOAT3>> cg::renderer::rasterization_renderer::compute_face_normals(size_t shape) const
+{
+	auto& vertex_buffer = model->get_vertex_buffers()[shape];
+	const compact_index_buffer& index_buffer = model->get_index_buffers()[shape];
+	const vertex_quantization& quantization = model->get_vertex_quantizations()[shape];
+
+	const size_t num_faces = index_buffer.get_number_of_elements() / 3;
+	auto normals = std::make_shared<resource<DirectX::XMFLOAT3>>(num_faces);
+	for (size_t face = 0; face != num_faces; ++face) {
+		const DirectX::XMFLOAT3 p0 = vertex_buffer->item(index_buffer.item(3 * face)).decode(quantization).position;
+		const DirectX::XMFLOAT3 p1 = vertex_buffer->item(index_buffer.item(3 * face + 1)).decode(quantization).position;
+		const DirectX::XMFLOAT3 p2 = vertex_buffer->item(index_buffer.item(3 * face + 2)).decode(quantization).position;
+		const DirectX::XMVECTOR v0 = DirectX::XMLoadFloat3(&p0);
+		const DirectX::XMVECTOR v1 = DirectX::XMLoadFloat3(&p1);
+		const DirectX::XMVECTOR v2 = DirectX::XMLoadFloat3(&p2);
+		const DirectX::XMVECTOR normal = DirectX::XMVector3Cross(
+				DirectX::XMVectorSubtract(v1, v0),
+				DirectX::XMVectorSubtract(v2, v0));
+		DirectX::XMStoreFloat3(&normals->item(face), DirectX::XMVector3Normalize(normal));
+	}
+	return normals;
+}
+
+void cg::renderer::rasterization_renderer::update_frame_constants(size_t frame_id)
+{
+	const DirectX::XMMATRIX projection = camera->get_projection_matrix();
+	const DirectX::XMMATRIX view_projection = DirectX::XMMatrixMultiply(camera->get_view_matrix(), projection);
+	frame.previous_view_projection = frame.view_projection;
+	DirectX::XMStoreFloat4x4(&frame.projection, projection);
+	DirectX::XMStoreFloat4x4(&frame.view_projection, view_projection);
+	if (frame_id == 0) {
+		frame.previous_view_projection = frame.view_projection;
+	}
+	DirectX::XMStoreFloat4x4(&frame.inverse_view_projection, DirectX::XMMatrixInverse(nullptr, view_projection));
+	DirectX::XMStoreFloat4x4(&frame.light_view_projection, DirectX::XMMatrixMultiply(light_camera->get_view_matrix(), light_camera->get_projection_matrix()));
+	DirectX::XMStoreFloat3(&frame.eye, camera->get_position());
+	DirectX::XMStoreFloat3(&frame.direction, DirectX::XMVector3Normalize(camera->get_direction()));
+
+	DirectX::BoundingFrustum view_space_frustum(projection);
+	view_space_frustum.Transform(frame.view_frustum, DirectX::XMMatrixInverse(nullptr, camera->get_view_matrix()));
+
+	// Halton (2, 3) offsets in [-0.5, 0.5) pixels, only when frames get resolved together
+	frame.jitter = history
+						   ? DirectX::XMFLOAT2{utils::halton(frame_id + 1, 2) - 0.5f, utils::halton(frame_id + 1, 3) - 0.5f}
+						   : DirectX::XMFLOAT2{0.0f, 0.0f};
+}
+
+void cg::renderer::rasterization_renderer::resolve_temporal(size_t frame_id)
+{
+	using namespace DirectX;
+
+	// Until the history is long enough this is a plain running average
+	constexpr float max_history_weight = 0.9f;
+	const float history_weight = std::min(max_history_weight, static_cast<float>(frame_id) / static_cast<float>(frame_id + 1));
+
+	const int width = static_cast<int>(get_render_width());
+	const int height = static_cast<int>(get_render_height());
+	const XMMATRIX previous_view_projection = XMLoadFloat4x4(&frame.previous_view_projection);
+
+	utils::parallel_for_tiles(get_render_width(), get_render_height(), 64, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				const XMVECTOR current = render_target->item(x, y).to_xmvector();
+				if (frame_id == 0) {
+					XMStoreFloat3(&resolved->item(x, y), current);
+					continue;
+				}
+
+				XMVECTOR neighbourhood_min = current;
+				XMVECTOR neighbourhood_max = current;
+				for (int dy = -1; dy <= 1; ++dy) {
+					for (int dx = -1; dx <= 1; ++dx) {
+						const size_t nx = static_cast<size_t>(std::clamp(static_cast<int>(x) + dx, 0, width - 1));
+						const size_t ny = static_cast<size_t>(std::clamp(static_cast<int>(y) + dy, 0, height - 1));
+						const XMVECTOR neighbour = render_target->item(nx, ny).to_xmvector();
+						neighbourhood_min = XMVectorMin(neighbourhood_min, neighbour);
+						neighbourhood_max = XMVectorMax(neighbourhood_max, neighbour);
+					}
+				}
 
-		rasterizer->draw(index_buffers[i]->get_number_of_elements());
+				// Follow the surface's motion through the previous frame's unjittered camera;
+				// the background stays put
+				float history_x = static_cast<float>(x);
+				float history_y = static_cast<float>(y);
+				const float depth = depth_buffer->item(x, y);
+				if (depth < settings->camera_z_far) {
+					const XMFLOAT3 screen_position{static_cast<float>(x), static_cast<float>(y), depth};
+					const XMVECTOR clip = XMVector3TransformCoord(reconstruct_world_position(screen_position), previous_view_projection);
+					history_x = (XMVectorGetX(clip) * 0.5f + 0.5f) * static_cast<float>(width) + frame.jitter.x;
+					history_y = (0.5f - XMVectorGetY(clip) * 0.5f) * static_cast<float>(height) + frame.jitter.y;
+				}
+
+				XMVECTOR output = current;
+				if (history_x >= 0.0f && history_y >= 0.0f && history_x <= static_cast<float>(width - 1) && history_y <= static_cast<float>(height - 1)) {
+					const size_t x0 = static_cast<size_t>(history_x);
+					const size_t y0 = static_cast<size_t>(history_y);
+					const size_t x1 = std::min(x0 + 1, static_cast<size_t>(width - 1));
+					const size_t y1 = std::min(y0 + 1, static_cast<size_t>(height - 1));
+					const float fx = history_x - static_cast<float>(x0);
+					const float fy = history_y - static_cast<float>(y0);
+					const XMVECTOR top = XMVectorLerp(XMLoadFloat3(&history->item(x0, y0)), XMLoadFloat3(&history->item(x1, y0)), fx);
+					const XMVECTOR bottom = XMVectorLerp(XMLoadFloat3(&history->item(x0, y1)), XMLoadFloat3(&history->item(x1, y1)), fx);
+
+					// Clamping to the current neighbourhood rejects history that no longer matches the scene
+					const XMVECTOR previous = XMVectorClamp(XMVectorLerp(top, bottom, fy), neighbourhood_min, neighbourhood_max);
+					output = XMVectorLerp(current, previous, history_weight);
+				}
+				XMStoreFloat3(&resolved->item(x, y), output);
+			}
+		}
+	});
+
+	std::swap(history, resolved);
+	for (size_t y = 0; y != get_render_height(); ++y) {
+		for (size_t x = 0; x != get_render_width(); ++x) {
+			render_target->item(x, y) = unsigned_color::from_xmvector(XMLoadFloat3(&history->item(x, y)));
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::apply_ambient_occlusion()
+{
+	ssao.compute(*depth_buffer, frame.projection, settings->camera_z_near, settings->camera_z_far);
+
+	utils::parallel_for_tiles(get_render_width(), get_render_height(), 64, [this](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				unsigned_color& pixel = render_target->item(x, y);
+				pixel = unsigned_color::from_float3(pixel.to_float3() * ssao.get(x, y));
+			}
+		}
+	});
+}
+
+void cg::renderer::rasterization_renderer::apply_reflections()
+{
+	using namespace DirectX;
+
+	ssr.build_hierarchy(*depth_buffer);
+	*reflection_source = *render_target;
+
+	const float width = static_cast<float>(get_render_width());
+	const float height = static_cast<float>(get_render_height());
+	const XMMATRIX view = camera->get_view_matrix();
+	const XMMATRIX projection = camera->get_projection_matrix();
+	const XMVECTOR eye = XMLoadFloat3(&frame.eye);
+	const XMVECTOR camera_direction = XMLoadFloat3(&frame.direction);
+	const XMVECTOR environment = XMVectorSet(
+			settings->ssr_environment_color[0],
+			settings->ssr_environment_color[1],
+			settings->ssr_environment_color[2],
+			0.0f);
+	// Hits near the screen border fade into the environment colour instead of cutting off
+	const float fade_distance = 0.1f * std::min(width, height);
+
+	utils::parallel_for_tiles(get_render_width(), get_render_height(), 32, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				const visibility_sample& sample = visibility_buffer->item(x, y);
+				if (sample.draw_constant == visibility_sample::invalid) {
+					continue;
+				}
+				const uint16_t material_id = model->get_material_id_buffers()[sample.draw_constant]->item(sample.primitive_id);
+				const material& surface = model->get_materials()[material_id];
+				if (std::max({surface.specular.x, surface.specular.y, surface.specular.z}) <= 0.0f) {
+					continue;
+				}
+
+				const XMFLOAT3 screen_position{static_cast<float>(x), static_cast<float>(y), depth_buffer->item(x, y)};
+				const XMVECTOR position = reconstruct_world_position(screen_position);
+				const XMVECTOR eye_offset = XMVectorSubtract(position, eye);
+				XMVECTOR normal = XMLoadFloat3(&face_normals[sample.draw_constant]->item(sample.primitive_id));
+				if (XMVectorGetX(XMVector3Dot(normal, eye_offset)) > 0.0f) {
+					normal = XMVectorNegate(normal);
+				}
+				const XMVECTOR direction = XMVector3Reflect(XMVector3Normalize(eye_offset), normal);
+
+				// Rays coming back towards the camera end just in front of the near plane
+				float ray_length = settings->camera_z_far;
+				const float view_depth = XMVectorGetX(XMVector3Dot(eye_offset, camera_direction));
+				const float depth_rate = XMVectorGetX(XMVector3Dot(direction, camera_direction));
+				if (depth_rate < 0.0f) {
+					ray_length = std::min(ray_length, (view_depth - 1.01f * settings->camera_z_near) / -depth_rate);
+				}
+
+				XMVECTOR reflection = environment;
+				XMFLOAT3 ray_end;
+				XMStoreFloat3(&ray_end, XMVector3Project(XMVectorMultiplyAdd(direction, XMVectorReplicate(ray_length), position),
+														 0.0f, 0.0f, width, height, settings->camera_z_near, settings->camera_z_far,
+														 projection, view, XMMatrixIdentity()));
+				ray_end.x += frame.jitter.x;
+				ray_end.y += frame.jitter.y;
+
+				XMFLOAT2 hit;
+				if (ray_length > 0.0f && ssr.trace(screen_position, ray_end, hit)) {
+					const float border = std::min(std::min(hit.x, width - 1.0f - hit.x), std::min(hit.y, height - 1.0f - hit.y));
+					const XMVECTOR hit_color = reflection_source->item(static_cast<size_t>(hit.x), static_cast<size_t>(hit.y)).to_xmvector();
+					reflection = XMVectorLerp(environment, hit_color, std::clamp(border / fade_distance, 0.0f, 1.0f));
+				}
+
+				unsigned_color& pixel = render_target->item(x, y);
+				pixel = unsigned_color::from_xmvector(XMVectorAdd(pixel.to_xmvector(), XMColorModulate(XMLoadFloat3(&surface.specular), reflection)));
+			}
+		}
+	});
+}
+
+DirectX::XMVECTOR cg::renderer::rasterization_renderer::reconstruct_world_position(const DirectX::XMFLOAT3& screen_position) const
+{
+	const float ndc_x = (screen_position.x - frame.jitter.x) / static_cast<float>(get_render_width()) * 2.0f - 1.0f;
+	const float ndc_y = 1.0f - (screen_position.y - frame.jitter.y) / static_cast<float>(get_render_height()) * 2.0f;
+	const float ndc_z = (screen_position.z - settings->camera_z_near) / (settings->camera_z_far - settings->camera_z_near);
+
+	const DirectX::XMMATRIX inverse_view_projection = DirectX::XMLoadFloat4x4(&frame.inverse_view_projection);
+	return DirectX::XMVector3TransformCoord(DirectX::XMVectorSet(ndc_x, ndc_y, ndc_z, 1.0f), inverse_view_projection);
+}
+
+DirectX::XMVECTOR cg::renderer::rasterization_renderer::shade_point_light(
+		const cg::world::point_light& light, const cg::material& surface,
+		DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal) const
+{
+	using namespace DirectX;
+
+	const XMVECTOR light_vector = XMVectorSubtract(XMLoadFloat3(&light.position), position);
+	const float distance = XMVectorGetX(XMVector3Length(light_vector));
+	if (distance >= light.range || distance == 0.0f) {
+		return XMVectorZero();
+	}
+
+	// Inverse square falloff windowed to reach zero at the light range
+	const float ratio = distance / light.range;
+	const float window = std::clamp(1.0f - ratio * ratio * ratio * ratio, 0.0f, 1.0f);
+	const float attenuation = window * window / (distance * distance + 1.0f);
+
+	const float n_dot_l = std::max(XMVectorGetX(XMVector3Dot(normal, XMVectorScale(light_vector, 1.0f / distance))), 0.0f);
+	const XMVECTOR diffuse = XMColorModulate(XMLoadFloat3(&surface.diffuse), XMLoadFloat3(&light.color));
+	return XMVectorScale(diffuse, n_dot_l * attenuation);
+}
+
+void cg::renderer::rasterization_renderer::shade_quad(
+		const cg::renderer::rasterizer<compact_vertex, unsigned_color>& target,
+		const pixel_quad<vertex>& quad, std::array<color, 4>& output) const
+{
+	using namespace DirectX;
+
+	// A pixel covering more shadow texels than this radius spans is filtered undersampled
+	constexpr int max_pcf_radius = 4;
+
+	// The whole quad lies on one primitive, so its material and normal are looked up once
+	const size_t primitive_id = target.get_primitive_id();
+	const uint16_t material_id = model->get_material_id_buffers()[target.get_draw_constant()]->item(primitive_id);
+	const material& surface = model->get_materials()[material_id];
+
+	// Lane positions step from lane 0 by the quad derivatives and are kept one lane per vector component
+	const XMVECTOR step_x = XMVectorSet(0.0f, 1.0f, 0.0f, 1.0f);
+	const XMVECTOR step_y = XMVectorSet(0.0f, 0.0f, 1.0f, 1.0f);
+	const auto lanes = [&](float value, float ddx, float ddy) {
+		return XMVectorMultiplyAdd(step_y, XMVectorReplicate(ddy), XMVectorMultiplyAdd(step_x, XMVectorReplicate(ddx), XMVectorReplicate(value)));
+	};
+	const XMFLOAT3& origin = quad.data[0].position;
+	const XMVECTOR screen_x = lanes(origin.x, quad.ddx.position.x, quad.ddy.position.x);
+	const XMVECTOR screen_y = lanes(origin.y, quad.ddx.position.y, quad.ddy.position.y);
+	const XMVECTOR screen_z = lanes(origin.z, quad.ddx.position.z, quad.ddy.position.z);
+
+	// Same reconstruction as reconstruct_world_position, for all four lanes at once
+	const float width = static_cast<float>(get_render_width());
+	const float height = static_cast<float>(get_render_height());
+	XMVECTOR world_x = XMVectorSubtract(XMVectorScale(XMVectorSubtract(screen_x, XMVectorReplicate(frame.jitter.x)), 2.0f / width), XMVectorSplatOne());
+	XMVECTOR world_y = XMVectorSubtract(XMVectorSplatOne(), XMVectorScale(XMVectorSubtract(screen_y, XMVectorReplicate(frame.jitter.y)), 2.0f / height));
+	XMVECTOR world_z = XMVectorScale(XMVectorSubtract(screen_z, XMVectorReplicate(settings->camera_z_near)), 1.0f / (settings->camera_z_far - settings->camera_z_near));
+	transform_coord_lanes(frame.inverse_view_projection, world_x, world_y, world_z);
+
+	const XMVECTOR eye_x = XMVectorSubtract(world_x, XMVectorReplicate(frame.eye.x));
+	const XMVECTOR eye_y = XMVectorSubtract(world_y, XMVectorReplicate(frame.eye.y));
+	const XMVECTOR eye_z = XMVectorSubtract(world_z, XMVectorReplicate(frame.eye.z));
+	XMFLOAT4 view_depth;
+	XMStoreFloat4(&view_depth, XMVectorMultiplyAdd(eye_z, XMVectorReplicate(frame.direction.z),
+												   XMVectorMultiplyAdd(eye_y, XMVectorReplicate(frame.direction.y), XMVectorMultiply(eye_x, XMVectorReplicate(frame.direction.x)))));
+
+	// Every lane lies on the face plane, so lane 0 tells which side the viewer is on for all of them
+	XMFLOAT3 normal = face_normals[target.get_draw_constant()]->item(primitive_id);
+	if (normal.x * XMVectorGetX(eye_x) + normal.y * XMVectorGetX(eye_y) + normal.z * XMVectorGetX(eye_z) > 0.0f) {
+		normal = {-normal.x, -normal.y, -normal.z};
+	}
+
+	// Shadow map footprint of a pixel from the light space ddx and ddy of the quad, in texels
+	const float resolution = static_cast<float>(settings->shadow_map_resolution);
+	XMVECTOR light_x = world_x;
+	XMVECTOR light_y = world_y;
+	XMVECTOR light_z = world_z;
+	transform_coord_lanes(frame.light_view_projection, light_x, light_y, light_z);
+	XMFLOAT4 shadow_x, shadow_y, shadow_z;
+	XMStoreFloat4(&shadow_x, XMVectorScale(XMVectorAdd(light_x, XMVectorSplatOne()), 0.5f * resolution));
+	XMStoreFloat4(&shadow_y, XMVectorScale(XMVectorSubtract(XMVectorSplatOne(), light_y), 0.5f * resolution));
+	XMStoreFloat4(&shadow_z, light_z);
+	const float footprint = std::max(std::hypot(shadow_x.y - shadow_x.x, shadow_y.y - shadow_y.x),
+									 std::hypot(shadow_x.z - shadow_x.x, shadow_y.z - shadow_y.x));
+	const int pcf_radius = std::clamp(static_cast<int>(std::ceil(0.5f * footprint)), 1, max_pcf_radius);
+
+	constexpr float ambient_intensity = 0.1f;
+	const XMVECTOR base = XMVectorAdd(XMLoadFloat3(&surface.emissive), XMVectorScale(XMLoadFloat3(&surface.ambient), ambient_intensity));
+	std::array<XMVECTOR, 4> lane_output{base, base, base, base};
+
+	XMFLOAT4 pixel_x, pixel_y;
+	XMStoreFloat4(&pixel_x, XMVectorMax(screen_x, XMVectorZero()));
+	XMStoreFloat4(&pixel_y, XMVectorMax(screen_y, XMVectorZero()));
+	const std::array<float, 4> lane_pixel_x{pixel_x.x, pixel_x.y, pixel_x.z, pixel_x.w};
+	const std::array<float, 4> lane_pixel_y{pixel_y.x, pixel_y.y, pixel_y.z, pixel_y.w};
+	const std::array<float, 4> lane_view_depth{view_depth.x, view_depth.y, view_depth.z, view_depth.w};
+	const std::array<XMFLOAT3, 4> lane_shadow{
+			XMFLOAT3{shadow_x.x, shadow_y.x, shadow_z.x}, XMFLOAT3{shadow_x.y, shadow_y.y, shadow_z.y},
+			XMFLOAT3{shadow_x.z, shadow_y.z, shadow_z.z}, XMFLOAT3{shadow_x.w, shadow_y.w, shadow_z.w}};
+
+	std::array<light_clusters::cluster_range, 4> clusters;
+	for (size_t lane = 0; lane != 4; ++lane) {
+		clusters[lane] = light_grid.get_cluster(static_cast<size_t>(lane_pixel_x[lane]), static_cast<size_t>(lane_pixel_y[lane]), lane_view_depth[lane]);
+	}
+
+	// Visible lanes sharing a light cluster are shaded together, usually the whole quad at once
+	std::array<bool, 4> shaded{!quad.mask[0], !quad.mask[1], !quad.mask[2], !quad.mask[3]};
+	for (size_t first = 0; first != 4; ++first) {
+		if (shaded[first]) {
+			continue;
+		}
+		const light_clusters::cluster_range cluster = clusters[first];
+		std::array<bool, 4> group{};
+		for (size_t lane = first; lane != 4; ++lane) {
+			group[lane] = !shaded[lane] && clusters[lane].offset == cluster.offset && clusters[lane].count == cluster.count;
+			shaded[lane] = shaded[lane] || group[lane];
+		}
+
+		for (unsigned int i = 0; i != cluster.count; ++i) {
+			const unsigned int light_id = light_grid.get_light_index(cluster.offset + i);
+			const cg::world::point_light& light = model->get_lights()[light_id];
+
+			// shade_point_light for four lanes: windowed inverse square falloff times n dot l
+			const XMVECTOR to_light_x = XMVectorSubtract(XMVectorReplicate(light.position.x), world_x);
+			const XMVECTOR to_light_y = XMVectorSubtract(XMVectorReplicate(light.position.y), world_y);
+			const XMVECTOR to_light_z = XMVectorSubtract(XMVectorReplicate(light.position.z), world_z);
+			const XMVECTOR distance_squared = XMVectorMultiplyAdd(to_light_z, to_light_z, XMVectorMultiplyAdd(to_light_y, to_light_y, XMVectorMultiply(to_light_x, to_light_x)));
+			const XMVECTOR distance = XMVectorSqrt(distance_squared);
+			const XMVECTOR range = XMVectorReplicate(light.range);
+
+			const XMVECTOR ratio = XMVectorDivide(distance, range);
+			const XMVECTOR ratio_squared = XMVectorMultiply(ratio, ratio);
+			const XMVECTOR window = XMVectorSaturate(XMVectorSubtract(XMVectorSplatOne(), XMVectorMultiply(ratio_squared, ratio_squared)));
+			const XMVECTOR attenuation = XMVectorDivide(XMVectorMultiply(window, window), XMVectorAdd(distance_squared, XMVectorSplatOne()));
+			const XMVECTOR projected = XMVectorMultiplyAdd(to_light_z, XMVectorReplicate(normal.z),
+														   XMVectorMultiplyAdd(to_light_y, XMVectorReplicate(normal.y), XMVectorMultiply(to_light_x, XMVectorReplicate(normal.x))));
+			const XMVECTOR n_dot_l = XMVectorMax(XMVectorDivide(projected, distance), XMVectorZero());
+
+			const XMVECTOR in_range = XMVectorAndInt(XMVectorLess(distance, range), XMVectorGreater(distance, XMVectorZero()));
+			XMFLOAT4 intensity;
+			XMStoreFloat4(&intensity, XMVectorSelect(XMVectorZero(), XMVectorMultiply(n_dot_l, attenuation), in_range));
+			const std::array<float, 4> lane_intensity{intensity.x, intensity.y, intensity.z, intensity.w};
+
+			const XMVECTOR diffuse = XMColorModulate(XMLoadFloat3(&surface.diffuse), XMLoadFloat3(&light.color));
+			for (size_t lane = first; lane != 4; ++lane) {
+				if (!group[lane] || lane_intensity[lane] == 0.0f) {
+					continue;
+				}
+				const float shadow = light_id == 0 ? sample_shadow(lane_shadow[lane], pcf_radius) : 1.0f;
+				lane_output[lane] = XMVectorAdd(lane_output[lane], XMVectorScale(diffuse, lane_intensity[lane] * shadow));
+			}
+		}
+	}
+
+	for (size_t lane = 0; lane != 4; ++lane) {
+		XMFLOAT3 result;
+		XMStoreFloat3(&result, lane_output[lane]);
+		output[lane] = color::from_XMFLOAT3(result);
+	}
+}
+
+float cg::renderer::rasterization_renderer::sample_shadow(DirectX::FXMVECTOR world_position) const
+{
+	constexpr int pcf_radius = 1;
+
+	const float resolution = static_cast<float>(settings->shadow_map_resolution);
+
+	DirectX::XMVECTOR address = world_position;
+	address = DirectX::XMVector3Project(address, 0.0f, 0.0f,
+										resolution,
+										resolution,
+										0.0f, 1.0f,
+										light_camera->get_projection_matrix(), light_camera->get_view_matrix(), DirectX::XMMatrixIdentity());
+
+	DirectX::XMFLOAT3 light_space;
+	DirectX::XMStoreFloat3(&light_space, address);
+	return sample_shadow(light_space, pcf_radius);
+}
+
+float cg::renderer::rasterization_renderer::sample_shadow(const DirectX::XMFLOAT3& light_space, int pcf_radius) const
+{
+	constexpr float depth_bias = 0.01f;
+
+	const int resolution = static_cast<int>(settings->shadow_map_resolution);
+	if (light_space.z < 0.0f || light_space.z > 1.0f) {
+		return 1.0f;
+	}
+
+	const float receiver_depth = linearize_shadow_depth(light_space.z) - depth_bias;
+	const int center_x = static_cast<int>(light_space.x);
+	const int center_y = static_cast<int>(light_space.y);
+
+	float lit = 0.0f;
+	for (int dy = -pcf_radius; dy <= pcf_radius; ++dy) {
+		for (int dx = -pcf_radius; dx <= pcf_radius; ++dx) {
+			const size_t x = static_cast<size_t>(std::clamp(center_x + dx, 0, resolution - 1));
+			const size_t y = static_cast<size_t>(std::clamp(center_y + dy, 0, resolution - 1));
+			if (receiver_depth <= linearize_shadow_depth(shadow_map->item(x, y))) {
+				lit += 1.0f;
+			}
+		}
+	}
+
+	const float num_taps = static_cast<float>((2 * pcf_radius + 1) * (2 * pcf_radius + 1));
+	return lit / num_taps;
+}
+
+float cg::renderer::rasterization_renderer::linearize_shadow_depth(float depth) const
+{
+	if (depth >= 1.0f) {
+		return FLT_MAX;
 	}
-	utils::save_resource(*render_target, settings->result_path);
+	const float z_near = light_camera->get_z_near();
+	const float z_far = light_camera->get_z_far();
+	return z_near * z_far / (z_far - depth * (z_far - z_near));
 }
\ No newline at end of file
@@ -1,23 +1,148 @@
+#include "renderer/rasterizer/ambient_occlusion.h"
+#include "renderer/rasterizer/light_clusters.h"
 #include "renderer/rasterizer/rasterizer.h"
+#include "renderer/rasterizer/screen_space_reflections.h"
 #include "renderer/renderer.h"
 #include "resource.h"
 
+#include <DirectXCollision.h>
+
 
 namespace cg::renderer
 {
+	// A contiguous index range of one shape, the unit of draw ordering
+	struct draw_cluster
+	{
+		size_t shape;
+		size_t first_index;
+		size_t num_indices;
+		DirectX::BoundingBox bounds;
+	};
+
+	// Sort-last rendering: a worker rasterizes its share of the clusters into private targets
+	struct sort_last_worker
+	{
+		std::shared_ptr<cg::renderer::rasterizer<cg::compact_vertex, cg::unsigned_color>> rasterizer;
+		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<visibility_sample>> visibility_buffer;
+		std::vector<size_t> clusters;
+	};
+
 	class rasterization_renderer : public renderer
 	{
 	public:
 		virtual void init();
 		virtual void destroy();
 
+		// Turns the animated shape by one animation step and damages what it covered before and after
 		virtual void update();
 		virtual void render();
 
+		// Damage accumulates until the next frame, which then redraws only the affected screen tiles
+		// while the camera stays put and no screen-space or temporal pass needs the whole frame.
+		// Shadows that changed outside the damaged area are not refreshed.
+		void invalidate_bounds(const DirectX::BoundingBox& world_bounds);
+		// Damages the old and the new screen area of a shape whose vertices were edited in place
+		void invalidate_shape(size_t shape);
+		void invalidate_material(size_t material_id);
+		void invalidate_all();
+
 	protected:
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<unsigned int>> overdraw_buffer;
+		// Tells the reflection pass which material covers each pixel
+		std::shared_ptr<cg::resource<visibility_sample>> visibility_buffer;
+		// Reflections read the lit frame from here while adding to the render target
+		std::shared_ptr<cg::resource<cg::unsigned_color>> reflection_source;
+
+		// Temporal anti-aliasing keeps its history in floating point to converge without banding
+		std::shared_ptr<cg::resource<DirectX::XMFLOAT3>> history;
+		std::shared_ptr<cg::resource<DirectX::XMFLOAT3>> resolved;
+
+		std::shared_ptr<cg::renderer::rasterizer<cg::compact_vertex, cg::unsigned_color>> rasterizer;
+		std::shared_ptr<cg::resource<shading_rate>> shading_rate_image;
+		static constexpr size_t shading_rate_tile = 16;
+
+		std::shared_ptr<cg::world::camera> light_camera;
+		std::shared_ptr<cg::resource<float>> shadow_map;
+		std::shared_ptr<cg::renderer::rasterizer<cg::compact_vertex, cg::unsigned_color>> shadow_rasterizer;
+
+		std::vector<draw_cluster> draw_clusters;
+		std::vector<std::unique_ptr<sort_last_worker>> workers;
+
+		static constexpr size_t damage_tile = 32;
+		std::vector<bool> damaged_tiles;
+		bool full_redraw = true;
+		// Whether the last render_frame redrew only the damaged tiles
+		bool last_frame_incremental = false;
+		DirectX::XMFLOAT4X4 presented_view_projection{};
+
+		// One list per recording thread, with the cluster behind each recorded draw
+		std::vector<command_list<cg::compact_vertex>> command_lists;
+		std::vector<std::vector<size_t>> recorded_clusters;
+
+		// One geometric normal per triangle, the model has no vertex normals
+		std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>> face_normals;
+
+		light_clusters light_grid;
+		ambient_occlusion ssao;
+		screen_space_reflections ssr;
+
+		// Camera data cached once per frame for the pixel shaders
+		struct frame_constants
+		{
+			DirectX::XMFLOAT4X4 projection;
+			DirectX::XMFLOAT4X4 view_projection;
+			DirectX::XMFLOAT4X4 inverse_view_projection;
+			DirectX::XMFLOAT4X4 previous_view_projection;
+			DirectX::XMFLOAT4X4 light_view_projection;
+			DirectX::XMFLOAT3 eye;
+			DirectX::XMFLOAT3 direction;
+			// Subpixel offset of this frame's samples, in pixels
+			DirectX::XMFLOAT2 jitter;
+			DirectX::BoundingFrustum view_frustum;
+		} frame{};
+
+		void build_draw_clusters();
+		std::vector<size_t> get_draw_order() const;
+		size_t measure_unsorted_depth_passes();
+
+		void build_face_normals();
+		std::shared_ptr<cg::resource<DirectX::XMFLOAT3>> compute_face_normals(size_t shape) const;
+		void compute_cluster_bounds(draw_cluster& cluster) const;
+		bool get_screen_rect(const DirectX::BoundingBox& world_bounds, std::array<size_t, 4>& rect) const;
+		bool can_render_incrementally() const;
+		void render_damaged_tiles();
+		// Renders the frame again from scratch and fails if the incremental result differs from it
+		void check_incremental_frame(size_t frame_id);
+		// The shaders read the shape index from the draw constant
+		void setup_main_pass(cg::renderer::rasterizer<cg::compact_vertex, cg::unsigned_color>& target);
+
+		void render_frame(size_t frame_id);
+		void render_clusters();
+		void record_clusters(command_list<cg::compact_vertex>& list, std::vector<size_t>& clusters,
+							 std::vector<size_t>::const_iterator begin, std::vector<size_t>::const_iterator end) const;
+		bool is_cluster_visible(const draw_cluster& cluster) const;
+		void render_sort_last();
+		void composite_workers();
+		void update_frame_constants(size_t frame_id);
+		void resolve_temporal(size_t frame_id);
+		void update_shading_rate_image(size_t frame_id);
+		void apply_ambient_occlusion();
+		void apply_reflections();
+
+		DirectX::XMVECTOR reconstruct_world_position(const DirectX::XMFLOAT3& screen_position) const;
+		DirectX::XMVECTOR shade_point_light(const cg::world::point_light& light, const cg::material& surface,
+											DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal) const;
+
+		// Shades a 2x2 quad four lanes at a time, its derivatives set the shadow filter width
+		void shade_quad(const cg::renderer::rasterizer<cg::compact_vertex, cg::unsigned_color>& target,
+						const cg::renderer::pixel_quad<cg::vertex>& quad, std::array<cg::color, 4>& output) const;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		float sample_shadow(DirectX::FXMVECTOR world_position) const;
+		float sample_shadow(const DirectX::XMFLOAT3& light_space, int pcf_radius) const;
+		float linearize_shadow_depth(float depth) const;
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "screen_space_reflections.h"
+
+#include "utils/parallel.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+namespace
+{
+	constexpr size_t tile_size = 32;
+}// namespace
+
+void cg::renderer::screen_space_reflections::set_resolution(size_t in_width, size_t in_height)
+{
+	width = in_width;
+	height = in_height;
+
+	levels.clear();
+	level_sizes.clear();
+	size_t level_width = width;
+	size_t level_height = height;
+	while (true) {
+		levels.push_back(std::make_unique<resource<float>>(level_width, level_height));
+		level_sizes.emplace_back(level_width, level_height);
+		if (level_width == 1 && level_height == 1) {
+			break;
+		}
+		level_width = (level_width + 1) / 2;
+		level_height = (level_height + 1) / 2;
+	}
+}
+
+void cg::renderer::screen_space_reflections::set_depth_range(float in_z_near, float in_z_far)
+{
+	z_near = in_z_near;
+	z_far = in_z_far;
+}
+
+void cg::renderer::screen_space_reflections::build_hierarchy(const cg::resource<float>& depth_buffer)
+{
+	utils::parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				levels[0]->item(x, y) = depth_buffer.item(x, y);
+			}
+		}
+	});
+	for (size_t level = 1; level != levels.size(); ++level) {
+		utils::parallel_for_tiles(level_sizes[level].first, level_sizes[level].second, tile_size,
+								  [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+									  downsample(level, x_begin, y_begin, x_end, y_end);
+								  });
+	}
+}
+
+bool cg::renderer::screen_space_reflections::trace(const DirectX::XMFLOAT3& start, const DirectX::XMFLOAT3& end, DirectX::XMFLOAT2& hit) const
+{
+	// Shifted by half a pixel so that pixel i covers [i, i + 1)
+	const float origin_x = start.x + 0.5f;
+	const float origin_y = start.y + 0.5f;
+	const float dx = end.x - start.x;
+	const float dy = end.y - start.y;
+	const float dz = end.z - start.z;
+
+	const float length = std::max(std::abs(dx), std::abs(dy));
+	if (length < 1.0f) {
+		return false;
+	}
+	// Cell borders are crossed by a hundredth of a pixel to avoid revisiting the same cell
+	const float nudge = 0.01f / length;
+
+	// The first pixels are skipped so the ray does not hit the surface it leaves
+	float t = 2.0f / length;
+	size_t level = 0;
+	const size_t top_level = levels.size() - 1;
+
+	for (size_t i = 0; i != max_iterations && t < 1.0f; ++i) {
+		const float x = origin_x + dx * t;
+		const float y = origin_y + dy * t;
+		const float z = start.z + dz * t;
+		if (x < 0.0f || y < 0.0f || x >= static_cast<float>(width) || y >= static_cast<float>(height)) {
+			return false;
+		}
+
+		const float cell_size = static_cast<float>(size_t{1} << level);
+		const size_t cell_x = std::min(static_cast<size_t>(x / cell_size), level_sizes[level].first - 1);
+		const size_t cell_y = std::min(static_cast<size_t>(y / cell_size), level_sizes[level].second - 1);
+		const float min_depth = levels[level]->item(cell_x, cell_y);
+
+		float t_exit = FLT_MAX;
+		if (dx > 0.0f) {
+			t_exit = std::min(t_exit, (static_cast<float>(cell_x + 1) * cell_size - origin_x) / dx);
+		}
+		else if (dx < 0.0f) {
+			t_exit = std::min(t_exit, (static_cast<float>(cell_x) * cell_size - origin_x) / dx);
+		}
+		if (dy > 0.0f) {
+			t_exit = std::min(t_exit, (static_cast<float>(cell_y + 1) * cell_size - origin_y) / dy);
+		}
+		else if (dy < 0.0f) {
+			t_exit = std::min(t_exit, (static_cast<float>(cell_y) * cell_size - origin_y) / dy);
+		}
+		t_exit += nudge;
+
+		if (z < min_depth) {
+			// The whole cell lies behind the ray: skip it at once, or go down to where the ray reaches its depth
+			const float t_depth = dz > 0.0f ? t + (min_depth - z) / dz : FLT_MAX;
+			if (t_exit <= t_depth) {
+				t = t_exit;
+				level = std::min(level + 1, top_level);
+			}
+			else if (level == 0) {
+				hit = {static_cast<float>(cell_x), static_cast<float>(cell_y)};
+				return true;
+			}
+			else {
+				t = t_depth;
+				--level;
+			}
+			continue;
+		}
+
+		if (level != 0) {
+			--level;
+			continue;
+		}
+
+		// Already behind this pixel: a hit if within the thickness, otherwise the ray passes behind it
+		if (z < z_far && linearize_depth(z) - linearize_depth(min_depth) <= thickness) {
+			hit = {static_cast<float>(cell_x), static_cast<float>(cell_y)};
+			return true;
+		}
+		t = t_exit;
+	}
+	return false;
+}
+
+void cg::renderer::screen_space_reflections::downsample(size_t level, size_t x_begin, size_t y_begin, size_t x_end, size_t y_end)
+{
+	const resource<float>& source = *levels[level - 1];
+	const size_t source_width = level_sizes[level - 1].first;
+	const size_t source_height = level_sizes[level - 1].second;
+
+	for (size_t y = y_begin; y != y_end; ++y) {
+		for (size_t x = x_begin; x != x_end; ++x) {
+			const size_t x1 = std::min(2 * x + 1, source_width - 1);
+			const size_t y1 = std::min(2 * y + 1, source_height - 1);
+			levels[level]->item(x, y) = std::min(
+					std::min(source.item(2 * x, 2 * y), source.item(x1, 2 * y)),
+					std::min(source.item(2 * x, y1), source.item(x1, y1)));
+		}
+	}
+}
+
+float cg::renderer::screen_space_reflections::linearize_depth(float depth) const
+{
+	// The viewport maps ndc depth d to z_near + d * (z_far - z_near)
+	return z_near * z_far / (z_far + z_near - depth);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "resource.h"
+
+#include <DirectXMath.h>
+#include <memory>
+#include <vector>
+
+
+namespace cg::renderer
+{
+	// Screen-space ray marcher over a hierarchical min-depth buffer. Depth is the viewport depth
+	// written with a [z_near, z_far] range, which is linear in screen space, so rays are marched as
+	// straight segments in (x, y, depth) and only the final hit test uses linear depth.
+	class screen_space_reflections
+	{
+	public:
+		static constexpr size_t max_iterations = 128;
+
+		void set_resolution(size_t in_width, size_t in_height);
+		void set_depth_range(float in_z_near, float in_z_far);
+
+		// Rebuilds the min-depth pyramid, level 0 is a copy of the depth buffer
+		void build_hierarchy(const cg::resource<float>& depth_buffer);
+
+		// Marches from start to end, both in screen space with pixel centres at integer coordinates.
+		// Returns true and the pixel that was hit when the segment passes behind the depth buffer
+		// within a thickness of the surface there.
+		bool trace(const DirectX::XMFLOAT3& start, const DirectX::XMFLOAT3& end, DirectX::XMFLOAT2& hit) const;
+
+	protected:
+		size_t width = 0;
+		size_t height = 0;
+		float z_near = 0.001f;
+		float z_far = 100.f;
+
+		// World space depth behind a surface that still counts as hitting it
+		static constexpr float thickness = 0.05f;
+
+		std::vector<std::unique_ptr<cg::resource<float>>> levels;
+		std::vector<std::pair<size_t, size_t>> level_sizes;
+
+		void downsample(size_t level, size_t x_begin, size_t y_begin, size_t x_end, size_t y_end);
+		float linearize_depth(float depth) const;
+	};
+}// namespace cg::renderer
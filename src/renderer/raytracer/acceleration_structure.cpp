@@ -0,0 +1,247 @@
+#include "acceleration_structure.h"
+
+#include <numeric>
+
+
+void cg::renderer::aabb::grow(const DirectX::XMFLOAT3& point)
+{
+	min = {std::min(min.x, point.x), std::min(min.y, point.y), std::min(min.z, point.z)};
+	max = {std::max(max.x, point.x), std::max(max.y, point.y), std::max(max.z, point.z)};
+}
+
+void cg::renderer::aabb::grow(const aabb& other)
+{
+	min = {std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z)};
+	max = {std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z)};
+}
+
+float cg::renderer::aabb::get_surface_area() const
+{
+	if (min.x > max.x)
+	{
+		return 0.0f;
+	}
+	const float dx = max.x - min.x;
+	const float dy = max.y - min.y;
+	const float dz = max.z - min.z;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+DirectX::XMFLOAT3 cg::renderer::aabb::get_center() const
+{
+	return {(min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f};
+}
+
+void cg::renderer::bvh::build(const std::vector<aabb>& primitive_bounds, size_t in_group_size)
+{
+	group_size = std::max<size_t>(in_group_size, 1);
+	nodes.clear();
+	primitive_indices.resize(primitive_bounds.size());
+	std::iota(primitive_indices.begin(), primitive_indices.end(), 0);
+	if (primitive_bounds.empty())
+	{
+		return;
+	}
+
+	std::vector<DirectX::XMFLOAT3> centers(primitive_bounds.size());
+	for (size_t i = 0; i != primitive_bounds.size(); ++i)
+	{
+		centers[i] = primitive_bounds[i].get_center();
+	}
+
+	nodes.reserve(2 * primitive_bounds.size() - 1);
+	nodes.push_back({});
+	nodes[0].first = 0;
+	nodes[0].count = static_cast<uint32_t>(primitive_bounds.size());
+	update_bounds(nodes[0], primitive_bounds);
+	subdivide(0, 0, primitive_bounds, centers);
+	build_cost = get_cost();
+}
+
+void cg::renderer::bvh::refit(const std::vector<aabb>& primitive_bounds)
+{
+	// Children are always stored after their parent, so a backwards sweep visits them first
+	for (size_t node_index = nodes.size(); node_index-- != 0;)
+	{
+		bvh_node& node = nodes[node_index];
+		if (node.is_leaf())
+		{
+			update_bounds(node, primitive_bounds);
+			continue;
+		}
+		const bvh_node& left = nodes[node.first];
+		const bvh_node& right = nodes[node.first + 1];
+		node.bounds_min = {std::min(left.bounds_min.x, right.bounds_min.x), std::min(left.bounds_min.y, right.bounds_min.y), std::min(left.bounds_min.z, right.bounds_min.z)};
+		node.bounds_max = {std::max(left.bounds_max.x, right.bounds_max.x), std::max(left.bounds_max.y, right.bounds_max.y), std::max(left.bounds_max.z, right.bounds_max.z)};
+	}
+}
+
+float cg::renderer::bvh::get_cost() const
+{
+	if (nodes.empty())
+	{
+		return 0.0f;
+	}
+
+	// Same units as the build: one per node visit and one per group test in a leaf
+	float cost = 0.0f;
+	for (const bvh_node& node: nodes)
+	{
+		aabb bounds;
+		bounds.min = node.bounds_min;
+		bounds.max = node.bounds_max;
+		cost += bounds.get_surface_area() * static_cast<float>(node.is_leaf() ? get_group_count(node.count) : 1);
+	}
+
+	aabb root_bounds;
+	root_bounds.min = nodes[0].bounds_min;
+	root_bounds.max = nodes[0].bounds_max;
+	const float root_area = root_bounds.get_surface_area();
+	return root_area > 0.0f ? cost / root_area : 0.0f;
+}
+
+float cg::renderer::bvh::get_build_cost() const
+{
+	return build_cost;
+}
+
+const std::vector<uint32_t>& cg::renderer::bvh::get_primitive_indices() const
+{
+	return primitive_indices;
+}
+
+const std::vector<cg::renderer::bvh_node>& cg::renderer::bvh::get_nodes() const
+{
+	return nodes;
+}
+
+bool cg::renderer::bvh::empty() const
+{
+	return nodes.empty();
+}
+
+size_t cg::renderer::bvh::get_group_count(size_t count) const
+{
+	return (count + group_size - 1) / group_size;
+}
+
+void cg::renderer::bvh::subdivide(uint32_t node_index, size_t depth, const std::vector<aabb>& primitive_bounds, const std::vector<DirectX::XMFLOAT3>& centers)
+{
+	const uint32_t first = nodes[node_index].first;
+	const uint32_t count = nodes[node_index].count;
+	if (count <= 1 || depth == max_depth)
+	{
+		return;
+	}
+
+	aabb center_bounds;
+	for (uint32_t i = first; i != first + count; ++i)
+	{
+		center_bounds.grow(centers[primitive_indices[i]]);
+	}
+
+	// Centres are binned along each axis, every bin border is a candidate split
+	size_t best_axis = 0;
+	size_t best_split = 0;
+	float best_cost = FLT_MAX;
+	for (size_t axis = 0; axis != 3; ++axis)
+	{
+		const float axis_min = (&center_bounds.min.x)[axis];
+		const float extent = (&center_bounds.max.x)[axis] - axis_min;
+		if (extent <= 0.0f)
+		{
+			continue;
+		}
+		const float scale = static_cast<float>(num_bins) / extent;
+
+		std::array<aabb, num_bins> bin_bounds;
+		std::array<uint32_t, num_bins> bin_counts{};
+		for (uint32_t i = first; i != first + count; ++i)
+		{
+			const uint32_t primitive = primitive_indices[i];
+			const size_t bin = std::min(static_cast<size_t>(((&centers[primitive].x)[axis] - axis_min) * scale), num_bins - 1);
+			bin_bounds[bin].grow(primitive_bounds[primitive]);
+			++bin_counts[bin];
+		}
+
+		// Sweep from the right to get the cost of everything past each border
+		std::array<float, num_bins> right_costs;
+		aabb right_bounds;
+		uint32_t right_count = 0;
+		for (size_t bin = num_bins - 1; bin != 0; --bin)
+		{
+			right_bounds.grow(bin_bounds[bin]);
+			right_count += bin_counts[bin];
+			right_costs[bin] = right_bounds.get_surface_area() * static_cast<float>(get_group_count(right_count));
+		}
+
+		aabb left_bounds;
+		uint32_t left_count = 0;
+		for (size_t split = 1; split != num_bins; ++split)
+		{
+			left_bounds.grow(bin_bounds[split - 1]);
+			left_count += bin_counts[split - 1];
+			if (left_count == 0 || left_count == count)
+			{
+				continue;
+			}
+			const float cost = left_bounds.get_surface_area() * static_cast<float>(get_group_count(left_count)) + right_costs[split];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = split;
+			}
+		}
+	}
+
+	if (best_cost == FLT_MAX)
+	{
+		return;
+	}
+
+	aabb node_bounds;
+	node_bounds.min = nodes[node_index].bounds_min;
+	node_bounds.max = nodes[node_index].bounds_max;
+	// Costs are in units of one group test, a node visit is counted as one more
+	const float leaf_cost = node_bounds.get_surface_area() * static_cast<float>(get_group_count(count));
+	if (count <= std::max(max_leaf_size, group_size) && node_bounds.get_surface_area() + best_cost >= leaf_cost)
+	{
+		return;
+	}
+
+	const float axis_min = (&center_bounds.min.x)[best_axis];
+	const float scale = static_cast<float>(num_bins) / ((&center_bounds.max.x)[best_axis] - axis_min);
+	const auto middle = std::partition(primitive_indices.begin() + first, primitive_indices.begin() + first + count, [&](uint32_t primitive) {
+		const size_t bin = std::min(static_cast<size_t>(((&centers[primitive].x)[best_axis] - axis_min) * scale), num_bins - 1);
+		return bin < best_split;
+	});
+	const uint32_t left_count = static_cast<uint32_t>(middle - primitive_indices.begin()) - first;
+
+	const uint32_t left_child = static_cast<uint32_t>(nodes.size());
+	nodes.push_back({});
+	nodes.push_back({});
+	nodes[left_child].first = first;
+	nodes[left_child].count = left_count;
+	nodes[left_child + 1].first = first + left_count;
+	nodes[left_child + 1].count = count - left_count;
+	update_bounds(nodes[left_child], primitive_bounds);
+	update_bounds(nodes[left_child + 1], primitive_bounds);
+
+	nodes[node_index].first = left_child;
+	nodes[node_index].count = 0;
+
+	subdivide(left_child, depth + 1, primitive_bounds, centers);
+	subdivide(left_child + 1, depth + 1, primitive_bounds, centers);
+}
+
+void cg::renderer::bvh::update_bounds(bvh_node& node, const std::vector<aabb>& primitive_bounds) const
+{
+	aabb bounds;
+	for (uint32_t i = node.first; i != node.first + node.count; ++i)
+	{
+		bounds.grow(primitive_bounds[primitive_indices[i]]);
+	}
+	node.bounds_min = bounds.min;
+	node.bounds_max = bounds.max;
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "DirectXMath.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+namespace cg::renderer
+{
+	struct aabb
+	{
+		DirectX::XMFLOAT3 min{FLT_MAX, FLT_MAX, FLT_MAX};
+		DirectX::XMFLOAT3 max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+		void grow(const DirectX::XMFLOAT3& point);
+		void grow(const aabb& other);
+		float get_surface_area() const;
+		DirectX::XMFLOAT3 get_center() const;
+	};
+
+	// Node of a bounding volume hierarchy, 32 bytes. Inner nodes keep their two children next to each
+	// other at first, leaves reference count primitives starting at first.
+	struct bvh_node
+	{
+		DirectX::XMFLOAT3 bounds_min;
+		uint32_t first;
+		DirectX::XMFLOAT3 bounds_max;
+		uint32_t count;
+
+		bool is_leaf() const
+		{
+			return count != 0;
+		}
+	};
+
+	// Ray in the form the slab test wants it
+	struct bvh_ray
+	{
+		DirectX::XMFLOAT3 origin;
+		DirectX::XMFLOAT3 inverse_direction;
+	};
+
+	// Planes through the shared origin of a ray packet that enclose all of its rays
+	struct bvh_frustum
+	{
+		DirectX::XMFLOAT3 origin;
+		std::array<DirectX::XMFLOAT3, 4> normals;
+
+		// True when the node lies entirely outside one of the planes
+		bool excludes(const bvh_node& node) const
+		{
+			for (const DirectX::XMFLOAT3& normal: normals)
+			{
+				const float x = (normal.x >= 0.0f ? node.bounds_max.x : node.bounds_min.x) - origin.x;
+				const float y = (normal.y >= 0.0f ? node.bounds_max.y : node.bounds_min.y) - origin.y;
+				const float z = (normal.z >= 0.0f ? node.bounds_max.z : node.bounds_min.z) - origin.z;
+				if (normal.x * x + normal.y * y + normal.z * z < 0.0f)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+	// Bounding volume hierarchy over arbitrary primitive bounds, split by the binned surface area heuristic
+	class bvh
+	{
+	public:
+		static constexpr size_t num_bins = 16;
+		static constexpr size_t max_leaf_size = 4;
+		// Keeps the traversal stack bounded, deeper ranges become leaves whatever their size
+		static constexpr size_t max_depth = 60;
+
+		// Leaves are tested group_size primitives at a time, so the heuristic counts groups rather than primitives
+		// and leaves may hold up to one group even when smaller ones would be cheaper
+		void build(const std::vector<aabb>& primitive_bounds, size_t group_size = 1);
+		// Recomputes the node bounds bottom-up for moved primitives, keeping the tree as it is
+		void refit(const std::vector<aabb>& primitive_bounds);
+
+		// Surface area heuristic cost of the tree relative to a single box around everything.
+		// It grows as refits stretch the nodes over primitives that moved apart.
+		float get_cost() const;
+		float get_build_cost() const;
+
+		// Primitive indices in leaf order, leaves index into this array
+		const std::vector<uint32_t>& get_primitive_indices() const;
+		const std::vector<bvh_node>& get_nodes() const;
+		bool empty() const;
+
+		// Visits the leaves the ray may hit, nearest child first. intersect(primitive, max_t) returns whether
+		// the primitive was hit and shrinks max_t to the hit, which culls every node behind it.
+		// With terminate_on_first_hit the traversal stops at the first reported hit.
+		template<typename F>
+		bool traverse(const bvh_ray& ray, float min_t, float& max_t, F&& intersect, bool terminate_on_first_hit = false) const;
+		// As traverse, but intersect_leaf(node_index, max_t) tests a whole leaf at once
+		template<typename F>
+		bool traverse_leaves(const bvh_ray& ray, float min_t, float& max_t, F&& intersect_leaf, bool terminate_on_first_hit = false) const;
+
+		// Any-hit traversal for occlusion: max_t stays fixed and the first leaf for which
+		// intersect_leaf(node_index) reports a hit ends it. Nearer children still go first.
+		template<typename F>
+		bool traverse_any(const bvh_ray& ray, float min_t, float max_t, F&& intersect_leaf) const;
+
+		// Traverses for a packet of rays at once. A node is skipped when it is outside the packet frustum
+		// or no ray enters it, and the rays before the first one that enters it are skipped in its subtree.
+		// intersect_leaf(node_index, ray_index, max_t) tests a leaf for one ray and shrinks that ray's max_t.
+		template<typename F>
+		void traverse_packet(const bvh_ray* rays, size_t num_rays, const bvh_frustum& frustum, float min_t, float* max_t, F&& intersect_leaf) const;
+		// As traverse_packet, but intersect_leaf(node_index, first_ray) takes a whole leaf with the rays from first_ray on
+		template<typename F>
+		void traverse_packet_leaves(const bvh_ray* rays, size_t num_rays, const bvh_frustum& frustum, float min_t, float* max_t, F&& intersect_leaf) const;
+
+		// Entry distance of the ray into the node, FLT_MAX when it misses the [min_t, max_t] interval
+		static float intersect_node(const bvh_node& node, const bvh_ray& ray, float min_t, float max_t);
+
+	protected:
+		std::vector<bvh_node> nodes;
+		std::vector<uint32_t> primitive_indices;
+		size_t group_size = 1;
+		float build_cost = 0.0f;
+
+		size_t get_group_count(size_t count) const;
+		void subdivide(uint32_t node_index, size_t depth, const std::vector<aabb>& primitive_bounds, const std::vector<DirectX::XMFLOAT3>& centers);
+		void update_bounds(bvh_node& node, const std::vector<aabb>& primitive_bounds) const;
+	};
+
+	inline bvh_ray make_bvh_ray(DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction)
+	{
+		bvh_ray result;
+		DirectX::XMStoreFloat3(&result.origin, origin);
+		DirectX::XMFLOAT3 dir;
+		DirectX::XMStoreFloat3(&dir, direction);
+		// A zero component gives an infinite inverse, which the slab test handles
+		result.inverse_direction = {1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z};
+		return result;
+	}
+
+	// Corner directions go around the packet in order, degenerate packets get planes that never cull
+	inline bvh_frustum make_bvh_frustum(DirectX::FXMVECTOR origin, const std::array<DirectX::XMFLOAT3, 4>& corners)
+	{
+		using namespace DirectX;
+
+		bvh_frustum result;
+		XMStoreFloat3(&result.origin, origin);
+		XMVECTOR center = XMVectorZero();
+		for (const XMFLOAT3& corner: corners)
+		{
+			center = XMVectorAdd(center, XMLoadFloat3(&corner));
+		}
+		for (size_t i = 0; i != 4; ++i)
+		{
+			XMVECTOR normal = XMVector3Cross(XMLoadFloat3(&corners[i]), XMLoadFloat3(&corners[(i + 1) % 4]));
+			if (XMVectorGetX(XMVector3Dot(normal, center)) < 0.0f)
+			{
+				normal = XMVectorNegate(normal);
+			}
+			XMStoreFloat3(&result.normals[i], normal);
+		}
+		return result;
+	}
+
+	inline float bvh::intersect_node(const bvh_node& node, const bvh_ray& ray, float min_t, float max_t)
+	{
+		float t_enter = min_t;
+		float t_exit = max_t;
+		// A ray parallel to a slab and starting on one of its planes gives 0 * inf = NaN, the comparisons
+		// below are false for NaN so that slab is skipped and the plane stays inside the node on every tree
+		const auto clip = [&](float t1, float t2) {
+			if (t1 > t2)
+			{
+				std::swap(t1, t2);
+			}
+			if (t1 > t_enter)
+			{
+				t_enter = t1;
+			}
+			if (t2 < t_exit)
+			{
+				t_exit = t2;
+			}
+		};
+		clip((node.bounds_min.x - ray.origin.x) * ray.inverse_direction.x, (node.bounds_max.x - ray.origin.x) * ray.inverse_direction.x);
+		clip((node.bounds_min.y - ray.origin.y) * ray.inverse_direction.y, (node.bounds_max.y - ray.origin.y) * ray.inverse_direction.y);
+		clip((node.bounds_min.z - ray.origin.z) * ray.inverse_direction.z, (node.bounds_max.z - ray.origin.z) * ray.inverse_direction.z);
+		return t_enter <= t_exit ? t_enter : FLT_MAX;
+	}
+
+	template<typename F>
+	inline bool bvh::traverse(const bvh_ray& ray, float min_t, float& max_t, F&& intersect, bool terminate_on_first_hit) const
+	{
+		return traverse_leaves(ray, min_t, max_t, [&](uint32_t node_index, float& leaf_max_t) {
+			const bvh_node& leaf = nodes[node_index];
+			bool hit = false;
+			for (uint32_t i = leaf.first; i != leaf.first + leaf.count; ++i)
+			{
+				if (intersect(primitive_indices[i], leaf_max_t))
+				{
+					hit = true;
+					if (terminate_on_first_hit)
+					{
+						break;
+					}
+				}
+			}
+			return hit;
+		}, terminate_on_first_hit);
+	}
+
+	template<typename F>
+	inline bool bvh::traverse_leaves(const bvh_ray& ray, float min_t, float& max_t, F&& intersect_leaf, bool terminate_on_first_hit) const
+	{
+		if (nodes.empty() || intersect_node(nodes[0], ray, min_t, max_t) == FLT_MAX)
+		{
+			return false;
+		}
+
+		// Far children wait on the stack together with their entry distance
+		std::array<std::pair<uint32_t, float>, 64> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, min_t};
+
+		bool hit = false;
+		while (stack_size != 0)
+		{
+			const auto [node_index, entry] = stack[--stack_size];
+			if (entry > max_t)
+			{
+				continue;
+			}
+
+			const bvh_node& node = nodes[node_index];
+			if (node.is_leaf())
+			{
+				if (intersect_leaf(node_index, max_t))
+				{
+					hit = true;
+					if (terminate_on_first_hit)
+					{
+						return true;
+					}
+				}
+				continue;
+			}
+
+			uint32_t near_child = node.first;
+			uint32_t far_child = node.first + 1;
+			float near_entry = intersect_node(nodes[near_child], ray, min_t, max_t);
+			float far_entry = intersect_node(nodes[far_child], ray, min_t, max_t);
+			if (far_entry < near_entry)
+			{
+				std::swap(near_child, far_child);
+				std::swap(near_entry, far_entry);
+			}
+			if (far_entry != FLT_MAX)
+			{
+				stack[stack_size++] = {far_child, far_entry};
+			}
+			if (near_entry != FLT_MAX)
+			{
+				stack[stack_size++] = {near_child, near_entry};
+			}
+		}
+		return hit;
+	}
+
+	template<typename F>
+	inline bool bvh::traverse_any(const bvh_ray& ray, float min_t, float max_t, F&& intersect_leaf) const
+	{
+		if (nodes.empty() || intersect_node(nodes[0], ray, min_t, max_t) == FLT_MAX)
+		{
+			return false;
+		}
+
+		std::array<uint32_t, 64> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size != 0)
+		{
+			const uint32_t node_index = stack[--stack_size];
+			const bvh_node& node = nodes[node_index];
+			if (node.is_leaf())
+			{
+				if (intersect_leaf(node_index))
+				{
+					return true;
+				}
+				continue;
+			}
+
+			uint32_t near_child = node.first;
+			uint32_t far_child = node.first + 1;
+			float near_entry = intersect_node(nodes[near_child], ray, min_t, max_t);
+			float far_entry = intersect_node(nodes[far_child], ray, min_t, max_t);
+			if (far_entry < near_entry)
+			{
+				std::swap(near_child, far_child);
+				std::swap(near_entry, far_entry);
+			}
+			if (far_entry != FLT_MAX)
+			{
+				stack[stack_size++] = far_child;
+			}
+			if (near_entry != FLT_MAX)
+			{
+				stack[stack_size++] = near_child;
+			}
+		}
+		return false;
+	}
+
+	template<typename F>
+	inline void bvh::traverse_packet(const bvh_ray* rays, size_t num_rays, const bvh_frustum& frustum, float min_t, float* max_t, F&& intersect_leaf) const
+	{
+		traverse_packet_leaves(rays, num_rays, frustum, min_t, max_t, [&](uint32_t node_index, size_t first_ray) {
+			const bvh_node& leaf = nodes[node_index];
+			for (size_t ray_index = first_ray; ray_index != num_rays; ++ray_index)
+			{
+				if (ray_index == first_ray || intersect_node(leaf, rays[ray_index], min_t, max_t[ray_index]) != FLT_MAX)
+				{
+					intersect_leaf(node_index, ray_index, max_t[ray_index]);
+				}
+			}
+		});
+	}
+
+	template<typename F>
+	inline void bvh::traverse_packet_leaves(const bvh_ray* rays, size_t num_rays, const bvh_frustum& frustum, float min_t, float* max_t, F&& intersect_leaf) const
+	{
+		if (nodes.empty() || num_rays == 0)
+		{
+			return;
+		}
+
+		// Nodes wait on the stack together with the first ray that may still enter them
+		std::array<std::pair<uint32_t, size_t>, 64> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0};
+
+		while (stack_size != 0)
+		{
+			auto [node_index, first_ray] = stack[--stack_size];
+			const bvh_node& node = nodes[node_index];
+			if (frustum.excludes(node))
+			{
+				continue;
+			}
+			while (first_ray != num_rays && intersect_node(node, rays[first_ray], min_t, max_t[first_ray]) == FLT_MAX)
+			{
+				++first_ray;
+			}
+			if (first_ray == num_rays)
+			{
+				continue;
+			}
+
+			if (node.is_leaf())
+			{
+				intersect_leaf(node_index, first_ray);
+				continue;
+			}
+
+			// Children go in the order the first active ray meets them
+			uint32_t near_child = node.first;
+			uint32_t far_child = node.first + 1;
+			if (intersect_node(nodes[far_child], rays[first_ray], min_t, max_t[first_ray]) <
+				intersect_node(nodes[near_child], rays[first_ray], min_t, max_t[first_ray]))
+			{
+				std::swap(near_child, far_child);
+			}
+			stack[stack_size++] = {far_child, first_ray};
+			stack[stack_size++] = {near_child, first_ray};
+		}
+	}
+}// namespace cg::renderer
@@ -1,15 +1,19 @@
 #pragma once
 
+#include "renderer/raytracer/acceleration_structure.h"
+#include "renderer/raytracer/triangle_packet.h"
 #include "resource.h"
+#include "utils/halton.h"
+#include "utils/parallel.h"
 #include "world/camera.h"
 
 #include "DirectXCollision.h"
 #include "DirectXMath.h"
 #include "linalg.h"
 
+#include <array>
 #include <cmath>
 #include <memory>
-#include <set>
 
 template<class T>
 bool IsEqual(const T v1, const T v2, const T tolerance = static_cast<T>(0.001))
@@ -61,11 +65,219 @@ namespace cg::renderer
 	{
 		float depth;
 		vertex point;
+		unsigned int material_id;
+	};
+
+	// A triangle of the scene compiled for intersection, 48 bytes. The shape and face fill
+	// the padding and lead back to the vertex attributes of a hit.
+	struct alignas(16) triangle_record
+	{
+		DirectX::XMFLOAT3 v0;
+		uint32_t shape;
+		DirectX::XMFLOAT3 edge1;
+		uint32_t face;
+		DirectX::XMFLOAT3 edge2;
+	};
+
+	// Nearest intersection found so far, its attributes are resolved once traversal ends
+	struct hit_record
+	{
+		float u = 0.0f;
+		float v = 0.0f;
+		uint32_t primitive = UINT32_MAX;
+		uint32_t instance = 0;
+	};
+
+	// Bottom-level acceleration structure over the triangles of one mesh in its own space,
+	// shared by every instance of the mesh
+	struct bottom_level_structure
+	{
+		bvh hierarchy;
+		std::vector<triangle_record> triangles;
+		// Leaf triangles regrouped for the SIMD kernel, each leaf starts at a packet of its own
+		std::vector<triangle_packet> triangle_packets;
+		std::vector<uint32_t> leaf_packets;
+
+		// A refit past this ratio of the build time cost rebuilds the hierarchy instead
+		static constexpr float max_refit_cost_ratio = 1.5f;
+
+		void build(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape);
+		// Moves the triangles to new positions of the same vertices and refits the hierarchy around them
+		void refit(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape);
+		bool empty() const;
+
+		bool intersect_leaf(uint32_t node_index, const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction,
+							float min_t, float& max_t, hit_record& hit, bool any_hit) const;
+		bool occludes_leaf(uint32_t node_index, const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction,
+						   float min_t, float max_t) const;
+
+	protected:
+		std::vector<aabb> update_triangles(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape);
+		void update_packets();
+	};
+
+	// Places a mesh, one vertex and index buffer pair, into the scene
+	struct instance
+	{
+		DirectX::XMFLOAT4X4 world;
+		uint32_t mesh;
+	};
+
+	inline void bottom_level_structure::build(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape)
+	{
+		hierarchy.build(update_triangles(positions, indices, shape), triangle_packet::width);
+		update_packets();
+	}
 
-		bool operator<(const payload& other) const
+	inline void bottom_level_structure::refit(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape)
+	{
+		if (indices.get_number_of_elements() / 3 != triangles.size())
+		{
+			build(positions, indices, shape);
+			return;
+		}
+
+		const std::vector<aabb> triangleBounds = update_triangles(positions, indices, shape);
+		hierarchy.refit(triangleBounds);
+		if (hierarchy.get_cost() > max_refit_cost_ratio * hierarchy.get_build_cost())
 		{
-			return depth < other.depth;
+			hierarchy.build(triangleBounds, triangle_packet::width);
 		}
+		update_packets();
+	}
+
+	inline std::vector<aabb> bottom_level_structure::update_triangles(const std::vector<DirectX::XMFLOAT3>& positions, const compact_index_buffer& indices, uint32_t shape)
+	{
+		using namespace DirectX;
+
+		triangles.clear();
+		std::vector<aabb> triangleBounds;
+		const size_t numFaces = indices.get_number_of_elements() / 3;
+		for (size_t faceIdx = 0; faceIdx != numFaces; ++faceIdx)
+		{
+			const XMFLOAT3& p0 = positions[indices.item(3 * faceIdx)];
+			const XMFLOAT3& p1 = positions[indices.item(3 * faceIdx + 1)];
+			const XMFLOAT3& p2 = positions[indices.item(3 * faceIdx + 2)];
+			aabb bounds;
+			bounds.grow(p0);
+			bounds.grow(p1);
+			bounds.grow(p2);
+
+			const XMVECTOR v0 = XMLoadFloat3(&p0);
+			triangle_record record;
+			record.v0 = p0;
+			XMStoreFloat3(&record.edge1, XMVectorSubtract(XMLoadFloat3(&p1), v0));
+			XMStoreFloat3(&record.edge2, XMVectorSubtract(XMLoadFloat3(&p2), v0));
+			record.shape = shape;
+			record.face = static_cast<uint32_t>(faceIdx);
+			triangles.push_back(record);
+			triangleBounds.push_back(bounds);
+		}
+		return triangleBounds;
+	}
+
+	inline void bottom_level_structure::update_packets()
+	{
+		const std::vector<bvh_node>& nodes = hierarchy.get_nodes();
+		const std::vector<uint32_t>& primitiveIndices = hierarchy.get_primitive_indices();
+		triangle_packets.clear();
+		leaf_packets.assign(nodes.size(), 0);
+		for (size_t nodeIdx = 0; nodeIdx != nodes.size(); ++nodeIdx)
+		{
+			if (!nodes[nodeIdx].is_leaf())
+			{
+				continue;
+			}
+			leaf_packets[nodeIdx] = static_cast<uint32_t>(triangle_packets.size());
+			for (uint32_t i = 0; i != nodes[nodeIdx].count; ++i)
+			{
+				const size_t lane = i % triangle_packet::width;
+				if (lane == 0)
+				{
+					triangle_packets.push_back({});
+				}
+				triangle_packet& packet = triangle_packets.back();
+				const uint32_t primitive = primitiveIndices[nodes[nodeIdx].first + i];
+				const triangle_record& record = triangles[primitive];
+				packet.v0_x[lane] = record.v0.x;
+				packet.v0_y[lane] = record.v0.y;
+				packet.v0_z[lane] = record.v0.z;
+				packet.edge1_x[lane] = record.edge1.x;
+				packet.edge1_y[lane] = record.edge1.y;
+				packet.edge1_z[lane] = record.edge1.z;
+				packet.edge2_x[lane] = record.edge2.x;
+				packet.edge2_y[lane] = record.edge2.y;
+				packet.edge2_z[lane] = record.edge2.z;
+				packet.primitive[lane] = primitive;
+			}
+		}
+	}
+
+	inline bool bottom_level_structure::empty() const
+	{
+		return hierarchy.empty();
+	}
+
+	inline bool bottom_level_structure::intersect_leaf(uint32_t node_index, const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction,
+													   float min_t, float& max_t, hit_record& hit, const bool any_hit) const
+	{
+		const bvh_node& leaf = hierarchy.get_nodes()[node_index];
+		const size_t numPackets = (leaf.count + triangle_packet::width - 1) / triangle_packet::width;
+
+		bool bLeafHit = false;
+		for (size_t packetIdx = leaf_packets[node_index]; packetIdx != leaf_packets[node_index] + numPackets; ++packetIdx)
+		{
+			float t, u, v;
+			const int lane = triangle_packets[packetIdx].intersect(origin, direction, min_t, max_t, t, u, v);
+			if (lane < 0)
+			{
+				continue;
+			}
+			// Ties go to the lower primitive, so the closest hit does not depend on the tree layout
+			const uint32_t primitive = triangle_packets[packetIdx].primitive[lane];
+			if (t == max_t && primitive >= hit.primitive)
+			{
+				continue;
+			}
+			max_t = t;
+			hit.u = u;
+			hit.v = v;
+			hit.primitive = primitive;
+			bLeafHit = true;
+			if (any_hit)
+			{
+				break;
+			}
+		}
+		return bLeafHit;
+	}
+
+	inline bool bottom_level_structure::occludes_leaf(uint32_t node_index, const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction,
+													  float min_t, float max_t) const
+	{
+		const bvh_node& leaf = hierarchy.get_nodes()[node_index];
+		const size_t numPackets = (leaf.count + triangle_packet::width - 1) / triangle_packet::width;
+		for (size_t packetIdx = leaf_packets[node_index]; packetIdx != leaf_packets[node_index] + numPackets; ++packetIdx)
+		{
+			if (triangle_packets[packetIdx].occludes(origin, direction, min_t, max_t))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Primary rays of a block of up to 8x8 pixels in row order, all leaving the same origin
+	struct ray_packet
+	{
+		static constexpr size_t width = 8;
+		static constexpr size_t max_size = width * width;
+
+		size_t size = 0;
+		DirectX::XMFLOAT3 origin;
+		std::array<DirectX::XMFLOAT3, max_size> directions;
+		std::array<bvh_ray, max_size> traversal_rays;
+		bvh_frustum frustum;
 	};
 
 	struct light
@@ -88,16 +300,41 @@ namespace cg::renderer
 
 		void set_camera(std::shared_ptr<world::camera> in_camera);
 
+		// Threads tracing tiles in launch_ray_generation, 0 uses every core
+		void set_num_threads(unsigned int in_num_threads);
+
+		// Primary rays are traced in 8x8 packets, secondary rays always one at a time
+		void set_packet_tracing(bool in_packet_tracing);
+
 		void set_vertex_buffers(std::vector<std::shared_ptr<resource<VB>>> in_vertex_buffers);
 
-		void set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers);
+		void set_vertex_quantizations(std::vector<vertex_quantization> in_vertex_quantizations);
+
+		void set_index_buffers(std::vector<compact_index_buffer> in_index_buffers);
+
+		void set_materials(std::vector<material> in_materials);
+
+		void set_material_id_buffers(std::vector<std::shared_ptr<resource<uint16_t>>> in_material_id_buffers);
+
+		// Without instances every mesh is placed once, untransformed
+		void set_instances(std::vector<instance> in_instances);
 
 		void build_acceleration_structure();
+		// Follows vertex buffers that changed in place and new instance transforms without a full build:
+		// mesh hierarchies are refitted unless that degraded them too far, the small top level is rebuilt
+		void update_acceleration_structure();
 
 		void launch_ray_generation(size_t frame_id);
 
 		bool trace_ray(const ray& ray, float max_t, float min_t, payload& payload, bool bIsShadowRay = false) const;
 
+		// Whether anything blocks the ray within [t_min, t_max]; stops at the first hit and resolves no attributes
+		bool occluded(const ray& ray, float t_min, float t_max) const;
+
+		// Traces the rays of a coherent packet together, hits[i] tells whether payloads[i] was filled
+		void trace_packet(const ray_packet& packet, float max_t, float min_t,
+						  std::array<payload, ray_packet::max_size>& payloads, std::array<bool, ray_packet::max_size>& hits) const;
+
 		DirectX::XMVECTOR hit_shader(const payload& p, const ray& camera_ray) const;
 
 		DirectX::XMVECTOR miss_shader(const payload& p, const ray& camera_ray) const;
@@ -113,14 +350,31 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<resource<RT>> render_target;
 		std::shared_ptr<resource<RT>> history;
-		std::vector<std::shared_ptr<resource<unsigned int>>> index_buffers;
+		std::vector<compact_index_buffer> index_buffers;
 		std::vector<std::shared_ptr<resource<VB>>> vertex_buffers;
-		std::vector<DirectX::BoundingBox> acceleration_structures;
+		std::vector<vertex_quantization> vertex_quantizations;
+		std::vector<std::shared_ptr<resource<uint16_t>>> material_id_buffers;
+		std::vector<material> materials;
+
+		// One bottom level per mesh, and a top level over the world space bounds of the instances
+		std::vector<bottom_level_structure> bottom_levels;
+		std::vector<instance> instances;
+		std::vector<DirectX::XMFLOAT4X4> inverse_worlds;
+		bvh top_level;
 
 		std::shared_ptr<world::camera> camera;
 
 		size_t width = 3440;
 		size_t height = 1440;
+
+		static constexpr size_t tile_size = 16;
+		unsigned int num_threads = 0;
+		bool packet_tracing = true;
+
+		std::vector<DirectX::XMFLOAT3> get_positions(size_t shape) const;
+		void build_top_level();
+		bool intersect_instances(uint32_t node_index, const ray& ray, float min_t, float& max_t, hit_record& hit, bool any_hit) const;
+		void resolve_hit(const hit_record& hit, float t, payload& out_payload) const;
 	};
 
 
@@ -148,29 +402,126 @@ namespace cg::renderer
 	}
 
 	template<typename VB, typename RT>
-	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers)
+	void raytracer<VB, RT>::set_index_buffers(std::vector<compact_index_buffer> in_index_buffers)
 	{
 		index_buffers = in_index_buffers;
 	}
 
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_materials(std::vector<material> in_materials)
+	{
+		materials = in_materials;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_material_id_buffers(std::vector<std::shared_ptr<resource<uint16_t>>> in_material_id_buffers)
+	{
+		material_id_buffers = in_material_id_buffers;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_vertex_quantizations(std::vector<vertex_quantization> in_vertex_quantizations)
+	{
+		vertex_quantizations = in_vertex_quantizations;
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = in_vertex_buffers;
 	}
 
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_instances(std::vector<instance> in_instances)
+	{
+		instances = in_instances;
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::build_acceleration_structure()
 	{
 		using namespace DirectX;
-		acceleration_structures.clear();
-		acceleration_structures.reserve(vertex_buffers.size());
 
-		for (std::shared_ptr<resource<VB>>& vb: vertex_buffers)
+		bottom_levels.assign(vertex_buffers.size(), {});
+		for (size_t shapeIdx = 0; shapeIdx != vertex_buffers.size(); ++shapeIdx)
+		{
+			bottom_levels[shapeIdx].build(get_positions(shapeIdx), index_buffers[shapeIdx], static_cast<uint32_t>(shapeIdx));
+		}
+
+		if (instances.empty())
+		{
+			XMFLOAT4X4 identity;
+			XMStoreFloat4x4(&identity, XMMatrixIdentity());
+			for (size_t shapeIdx = 0; shapeIdx != vertex_buffers.size(); ++shapeIdx)
+			{
+				instances.push_back({identity, static_cast<uint32_t>(shapeIdx)});
+			}
+		}
+		build_top_level();
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::update_acceleration_structure()
+	{
+		if (bottom_levels.size() != vertex_buffers.size())
+		{
+			build_acceleration_structure();
+			return;
+		}
+
+		for (size_t shapeIdx = 0; shapeIdx != vertex_buffers.size(); ++shapeIdx)
+		{
+			bottom_levels[shapeIdx].refit(get_positions(shapeIdx), index_buffers[shapeIdx], static_cast<uint32_t>(shapeIdx));
+		}
+		build_top_level();
+	}
+
+	template<typename VB, typename RT>
+	std::vector<DirectX::XMFLOAT3> raytracer<VB, RT>::get_positions(size_t shape) const
+	{
+		const std::shared_ptr<resource<VB>>& vb = vertex_buffers[shape];
+		std::vector<DirectX::XMFLOAT3> positions(vb->get_number_of_elements());
+		for (size_t i = 0; i != positions.size(); ++i)
+		{
+			positions[i] = vb->item(i).decode(vertex_quantizations[shape]).position;
+		}
+		return positions;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::build_top_level()
+	{
+		using namespace DirectX;
+
+		inverse_worlds.resize(instances.size());
+		std::vector<aabb> instanceBounds(instances.size());
+		for (size_t instanceIdx = 0; instanceIdx != instances.size(); ++instanceIdx)
 		{
-			acceleration_structures.emplace_back();
-			BoundingBox::CreateFromPoints(acceleration_structures.back(), vb->get_number_of_elements(), &vb->item(0).position, sizeof(VB));
+			const XMMATRIX world = XMLoadFloat4x4(&instances[instanceIdx].world);
+			XMStoreFloat4x4(&inverse_worlds[instanceIdx], XMMatrixInverse(nullptr, world));
+
+			// Empty meshes keep a point at their origin, their traversal ends right away
+			const bottom_level_structure& blas = bottom_levels.at(instances[instanceIdx].mesh);
+			if (blas.empty())
+			{
+				XMFLOAT3 origin;
+				XMStoreFloat3(&origin, XMVector3TransformCoord(XMVectorZero(), world));
+				instanceBounds[instanceIdx].grow(origin);
+				continue;
+			}
+			const bvh_node& root = blas.hierarchy.get_nodes()[0];
+			for (size_t corner = 0; corner != 8; ++corner)
+			{
+				const XMVECTOR local = XMVectorSet(corner & 1 ? root.bounds_max.x : root.bounds_min.x,
+												   corner & 2 ? root.bounds_max.y : root.bounds_min.y,
+												   corner & 4 ? root.bounds_max.z : root.bounds_min.z,
+												   1.0f);
+				XMFLOAT3 position;
+				XMStoreFloat3(&position, XMVector3TransformCoord(local, world));
+				instanceBounds[instanceIdx].grow(position);
+			}
 		}
+		top_level.build(instanceBounds);
 	}
 
 	template<typename VB, typename RT>
@@ -186,6 +537,18 @@ namespace cg::renderer
 		camera = in_camera;
 	}
 
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_num_threads(unsigned int in_num_threads)
+	{
+		num_threads = in_num_threads;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_packet_tracing(bool in_packet_tracing)
+	{
+		packet_tracing = in_packet_tracing;
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::launch_ray_generation(size_t frame_id)
 	{
@@ -204,111 +567,277 @@ namespace cg::renderer
 		jitter.y = (jitter.y * 2.0f - 1.0f) / h * 2;
 		projection.r[2] = XMVectorAdd(projection.r[2], XMLoadFloat2(&jitter));
 
-		for (size_t y = 0; y != height; ++y)
-		{
-			for (size_t x = 0; x != width; ++x)
-			{
-				const float fx = static_cast<float>(x);
-				const float fy = static_cast<float>(y);
-				const XMVECTOR pixel = XMVectorSet(fx, fy, 1.0f, 0.0f);
-				XMVECTOR pixelDir = XMVector3Normalize(XMVector3Unproject(pixel, 0.0f, 0.0f, w, h, 0.0f, 1.0f, projection, view, XMMatrixIdentity()));
-				ray r(eye, pixelDir);
-
-				payload p;
-				if (trace_ray(r, maxZ, minZ, p))
+		auto getPixelDirection = [&](size_t x, size_t y) {
+			const XMVECTOR pixel = XMVectorSet(static_cast<float>(x), static_cast<float>(y), 1.0f, 0.0f);
+			return XMVector3Normalize(XMVector3Unproject(pixel, 0.0f, 0.0f, w, h, 0.0f, 1.0f, projection, view, XMMatrixIdentity()));
+		};
+
+		utils::parallel_for_tiles(width, height, tile_size, [&](size_t xBegin, size_t yBegin, size_t xEnd, size_t yEnd) {
+			// Pixels are shaded into a private tile, so threads only meet on shared cache lines when a tile is written back
+			std::array<RT, tile_size * tile_size> tile;
+
+			auto shadePixel = [&](size_t x, size_t y, const ray& r, const bool bHit, const payload& p) {
+				RT& output = tile[(y - yBegin) * tile_size + (x - xBegin)];
+				output = render_target->item(x, y);
+				if (bHit)
 				{
-					const XMVECTOR output = hit_shader(p, r);
-					render_target->item(x, y) = unsigned_color::from_xmvector(output);
+					output = unsigned_color::from_xmvector(hit_shader(p, r));
 				}
 				else
 				{
-					const XMVECTOR output = miss_shader(p, r);
-					if (XMVectorGetX(XMVector3Length(output)) > 0)
+					const XMVECTOR missColor = miss_shader(p, r);
+					if (XMVectorGetX(XMVector3Length(missColor)) > 0)
 					{
-						render_target->item(x, y) = unsigned_color::from_xmvector(output);
+						output = unsigned_color::from_xmvector(missColor);
 					}
 				}
 
-				XMVECTOR current_color = render_target->item(x, y).to_xmvector();
-				const XMVECTOR history_color = history->item(x, y).to_xmvector();
 				if (frame_id > 0)
 				{
 					constexpr float mix_factor = 0.75f;
-					current_color = XMVectorLerp(current_color, history_color, mix_factor);
+					output = unsigned_color::from_xmvector(XMVectorLerp(output.to_xmvector(), history->item(x, y).to_xmvector(), mix_factor));
+				}
+			};
+
+			if (packet_tracing)
+			{
+				ray_packet packet;
+				std::array<payload, ray_packet::max_size> payloads;
+				std::array<bool, ray_packet::max_size> hits;
+				for (size_t blockY = yBegin; blockY < yEnd; blockY += ray_packet::width)
+				{
+					for (size_t blockX = xBegin; blockX < xEnd; blockX += ray_packet::width)
+					{
+						const size_t blockWidth = std::min(ray_packet::width, xEnd - blockX);
+						const size_t blockHeight = std::min(ray_packet::width, yEnd - blockY);
+						packet.size = blockWidth * blockHeight;
+						XMStoreFloat3(&packet.origin, eye);
+						for (size_t i = 0; i != packet.size; ++i)
+						{
+							const XMVECTOR direction = getPixelDirection(blockX + i % blockWidth, blockY + i / blockWidth);
+							XMStoreFloat3(&packet.directions[i], direction);
+							packet.traversal_rays[i] = make_bvh_ray(eye, direction);
+						}
+						packet.frustum = make_bvh_frustum(eye, {packet.directions[0],
+																packet.directions[blockWidth - 1],
+																packet.directions[packet.size - 1],
+																packet.directions[packet.size - blockWidth]});
+
+						trace_packet(packet, maxZ, minZ, payloads, hits);
+						for (size_t i = 0; i != packet.size; ++i)
+						{
+							const ray r(eye, XMLoadFloat3(&packet.directions[i]));
+							shadePixel(blockX + i % blockWidth, blockY + i / blockWidth, r, hits[i], payloads[i]);
+						}
+					}
 				}
-				render_target->item(x, y) = unsigned_color::from_xmvector(current_color);
-				history->item(x, y) = unsigned_color::from_xmvector(current_color);
 			}
-		}
+			else
+			{
+				for (size_t y = yBegin; y != yEnd; ++y)
+				{
+					for (size_t x = xBegin; x != xEnd; ++x)
+					{
+						const ray r(eye, getPixelDirection(x, y));
+						payload p;
+						const bool bHit = trace_ray(r, maxZ, minZ, p);
+						shadePixel(x, y, r, bHit, p);
+					}
+				}
+			}
+
+			for (size_t y = yBegin; y != yEnd; ++y)
+			{
+				for (size_t x = xBegin; x != xEnd; ++x)
+				{
+					const RT& output = tile[(y - yBegin) * tile_size + (x - xBegin)];
+					render_target->item(x, y) = output;
+					history->item(x, y) = output;
+				}
+			}
+		}, num_threads);
 	}
 
 	template<typename VB, typename RT>
 	bool raytracer<VB, RT>::trace_ray(
 			const ray& ray, float max_t, float min_t, payload& outPayload, const bool bIsShadowRay) const
 	{
-		using namespace DirectX;
-		std::set<payload> hits;
+		// Only the closest triangle so far is remembered, each hit shrinks closestT and with it the traversal
+		float closestT = max_t;
+		hit_record closest;
+		const bool bHit = top_level.traverse_leaves(make_bvh_ray(ray.position, ray.direction), min_t, closestT, [&](uint32_t nodeIdx, float& maxT) {
+			return intersect_instances(nodeIdx, ray, min_t, maxT, closest, bIsShadowRay);
+		}, bIsShadowRay);
+
+		if (!bHit)
+		{
+			return false;
+		}
 
-		for (size_t modelIdx = 0; modelIdx != index_buffers.size(); ++modelIdx)
+		if (bIsShadowRay)
 		{
-			if (float _; !acceleration_structures[modelIdx].Intersects(ray.position, ray.direction, _))
-			{
-				continue;
-			}
+			outPayload.depth = closestT;
+			return true;
+		}
+		resolve_hit(closest, closestT, outPayload);
+		return true;
+	}
 
-			const size_t numIndices = index_buffers.at(modelIdx)->get_number_of_elements();
-			const size_t numFaces = numIndices / 3;
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::intersect_instances(uint32_t node_index, const ray& ray, float min_t, float& max_t, hit_record& hit, const bool any_hit) const
+	{
+		using namespace DirectX;
 
-			for (size_t faceIdx = 0; faceIdx != numFaces; ++faceIdx)
+		const bvh_node& leaf = top_level.get_nodes()[node_index];
+		bool bHit = false;
+		for (uint32_t i = leaf.first; i != leaf.first + leaf.count; ++i)
+		{
+			const uint32_t instanceIdx = top_level.get_primitive_indices()[i];
+			const bottom_level_structure& blas = bottom_levels[instances[instanceIdx].mesh];
+
+			// The direction is not renormalised, so distances along the ray stay those of world space
+			const XMMATRIX inverseWorld = XMLoadFloat4x4(&inverse_worlds[instanceIdx]);
+			const XMVECTOR objectOrigin = XMVector3TransformCoord(ray.position, inverseWorld);
+			const XMVECTOR objectDirection = XMVector3TransformNormal(ray.direction, inverseWorld);
+			XMFLOAT3 origin;
+			XMFLOAT3 direction;
+			XMStoreFloat3(&origin, objectOrigin);
+			XMStoreFloat3(&direction, objectDirection);
+
+			const bool bInstanceHit = blas.hierarchy.traverse_leaves(make_bvh_ray(objectOrigin, objectDirection), min_t, max_t, [&](uint32_t blasNode, float& maxT) {
+				return blas.intersect_leaf(blasNode, origin, direction, min_t, maxT, hit, any_hit);
+			}, any_hit);
+			if (bInstanceHit)
 			{
-				std::array<vertex, 3> face;
-				std::array<XMVECTOR, 3> triangle;
-				for (size_t i = 0; i != 3; ++i)
+				hit.instance = instanceIdx;
+				bHit = true;
+				if (any_hit)
 				{
-					const unsigned index = index_buffers.at(modelIdx)->item(3 * faceIdx + i);
-					face.at(i) = vertex_buffers.at(modelIdx)->item(index);
-					triangle.at(i) = XMLoadFloat3(&face.at(i).position);
+					break;
 				}
+			}
+		}
+		return bHit;
+	}
 
-				const XMVECTOR faceBasisX = XMVectorSubtract(triangle.at(1), triangle.at(0));
-				const XMVECTOR faceBasisY = XMVectorSubtract(triangle.at(2), triangle.at(0));
-				const XMVECTOR normal = XMVector3Normalize(XMVector3Cross(faceBasisY, faceBasisX));
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::occluded(const ray& ray, float t_min, float t_max) const
+	{
+		using namespace DirectX;
 
-				float t;
-				if (TriangleTests::Intersects(ray.position, ray.direction,
-											  triangle.at(0), triangle.at(1), triangle.at(2),
-											  t))
+		return top_level.traverse_any(make_bvh_ray(ray.position, ray.direction), t_min, t_max, [&](uint32_t nodeIdx) {
+			const bvh_node& leaf = top_level.get_nodes()[nodeIdx];
+			for (uint32_t i = leaf.first; i != leaf.first + leaf.count; ++i)
+			{
+				const uint32_t instanceIdx = top_level.get_primitive_indices()[i];
+				const bottom_level_structure& blas = bottom_levels[instances[instanceIdx].mesh];
+
+				const XMMATRIX inverseWorld = XMLoadFloat4x4(&inverse_worlds[instanceIdx]);
+				const XMVECTOR objectOrigin = XMVector3TransformCoord(ray.position, inverseWorld);
+				const XMVECTOR objectDirection = XMVector3TransformNormal(ray.direction, inverseWorld);
+				XMFLOAT3 origin;
+				XMFLOAT3 direction;
+				XMStoreFloat3(&origin, objectOrigin);
+				XMStoreFloat3(&direction, objectDirection);
+
+				if (blas.hierarchy.traverse_any(make_bvh_ray(objectOrigin, objectDirection), t_min, t_max, [&](uint32_t blasNode) {
+						return blas.occludes_leaf(blasNode, origin, direction, t_min, t_max);
+					}))
 				{
-					if (t >= min_t && t <= max_t)
-					{
-						if (bIsShadowRay)
-						{
-							outPayload.depth = t;
-							return true;
-						}
+					return true;
+				}
+			}
+			return false;
+		});
+	}
 
-						const XMVECTOR hitPoint = XMVectorAdd(ray.position, XMVectorScale(ray.direction, t));
-						const XMVECTOR barycentric = XMFindBarycentric(hitPoint, triangle.at(0), triangle.at(1), triangle.at(2));
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::trace_packet(const ray_packet& packet, float max_t, float min_t,
+										 std::array<payload, ray_packet::max_size>& payloads, std::array<bool, ray_packet::max_size>& hits) const
+	{
+		using namespace DirectX;
 
-						assert(std::abs(XMVectorGetX(XMVectorSum(barycentric)) - 1.0f) < 0.001f);
+		std::array<float, ray_packet::max_size> closestT;
+		std::array<hit_record, ray_packet::max_size> closest;
+		std::fill(closestT.begin(), closestT.begin() + packet.size, max_t);
 
-						payload hit;
-						hit.depth = t;
-						hit.point = face.at(0) * XMVectorGetX(barycentric) + face.at(1) * XMVectorGetY(barycentric) + face.at(2) * XMVectorGetZ(barycentric);
+		std::array<XMFLOAT3, ray_packet::max_size> objectDirections;
+		std::array<bvh_ray, ray_packet::max_size> objectRays;
+		top_level.traverse_packet_leaves(packet.traversal_rays.data(), packet.size, packet.frustum, min_t, closestT.data(), [&](uint32_t nodeIdx, size_t firstRay) {
+			const bvh_node& leaf = top_level.get_nodes()[nodeIdx];
+			for (uint32_t i = leaf.first; i != leaf.first + leaf.count; ++i)
+			{
+				const uint32_t instanceIdx = top_level.get_primitive_indices()[i];
+				const bottom_level_structure& blas = bottom_levels[instances[instanceIdx].mesh];
+
+				// The packet moves into mesh space; frustum planes through the origin transform with the transposed world matrix
+				const XMMATRIX inverseWorld = XMLoadFloat4x4(&inverse_worlds[instanceIdx]);
+				const XMMATRIX planeTransform = XMMatrixTranspose(XMLoadFloat4x4(&instances[instanceIdx].world));
+				const XMVECTOR objectOrigin = XMVector3TransformCoord(XMLoadFloat3(&packet.origin), inverseWorld);
+				XMFLOAT3 origin;
+				XMStoreFloat3(&origin, objectOrigin);
+
+				bvh_frustum objectFrustum;
+				objectFrustum.origin = origin;
+				for (size_t plane = 0; plane != objectFrustum.normals.size(); ++plane)
+				{
+					XMStoreFloat3(&objectFrustum.normals[plane], XMVector3TransformNormal(XMLoadFloat3(&packet.frustum.normals[plane]), planeTransform));
+				}
+				for (size_t rayIdx = firstRay; rayIdx != packet.size; ++rayIdx)
+				{
+					const XMVECTOR objectDirection = XMVector3TransformNormal(XMLoadFloat3(&packet.directions[rayIdx]), inverseWorld);
+					XMStoreFloat3(&objectDirections[rayIdx], objectDirection);
+					objectRays[rayIdx] = make_bvh_ray(objectOrigin, objectDirection);
+				}
 
-						XMStoreFloat3(&hit.point.normal, normal);
+				blas.hierarchy.traverse_packet(objectRays.data() + firstRay, packet.size - firstRay, objectFrustum, min_t, closestT.data() + firstRay,
+											   [&](uint32_t blasNode, size_t rayIdx, float& maxT) {
+												   hit_record& hit = closest[firstRay + rayIdx];
+												   if (blas.intersect_leaf(blasNode, origin, objectDirections[firstRay + rayIdx], min_t, maxT, hit, false))
+												   {
+													   hit.instance = instanceIdx;
+												   }
+											   });
+			}
+		});
 
-						hits.insert(hit);
-					}
-				}
+		for (size_t i = 0; i != packet.size; ++i)
+		{
+			hits[i] = closest[i].primitive != UINT32_MAX;
+			if (hits[i])
+			{
+				resolve_hit(closest[i], closestT[i], payloads[i]);
 			}
 		}
+	}
 
-		if (!hits.empty())
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::resolve_hit(const hit_record& hit, float t, payload& out_payload) const
+	{
+		using namespace DirectX;
+
+		const triangle_record& hitTriangle = bottom_levels[instances[hit.instance].mesh].triangles[hit.primitive];
+		const size_t modelIdx = hitTriangle.shape;
+		const size_t faceIdx = hitTriangle.face;
+
+		std::array<vertex, 3> face;
+		for (size_t i = 0; i != 3; ++i)
 		{
-			outPayload = *hits.begin();
+			const unsigned index = index_buffers.at(modelIdx).item(3 * faceIdx + i);
+			face.at(i) = vertex_buffers.at(modelIdx)->item(index).decode(vertex_quantizations.at(modelIdx));
 		}
-		return !hits.empty();
+
+		// Attributes are interpolated in mesh space, then moved into the world with the instance
+		const XMMATRIX world = XMLoadFloat4x4(&instances[hit.instance].world);
+		const XMMATRIX normalTransform = XMMatrixTranspose(XMLoadFloat4x4(&inverse_worlds[hit.instance]));
+		const XMVECTOR objectNormal = XMVector3Cross(XMLoadFloat3(&hitTriangle.edge2), XMLoadFloat3(&hitTriangle.edge1));
+		const XMVECTOR normal = XMVector3Normalize(XMVector3TransformNormal(objectNormal, normalTransform));
+
+		out_payload.depth = t;
+		out_payload.point = face.at(0) * (1.0f - hit.u - hit.v) + face.at(1) * hit.u + face.at(2) * hit.v;
+		XMStoreFloat3(&out_payload.point.position, XMVector3TransformCoord(XMLoadFloat3(&out_payload.point.position), world));
+		XMStoreFloat3(&out_payload.point.normal, normal);
+		out_payload.material_id = material_id_buffers.at(modelIdx)->item(faceIdx);
 	}
 
 	template<typename VB, typename RT>
@@ -324,6 +853,8 @@ namespace cg::renderer
 		const std::vector<light> lights =
 				{{XMVectorSet(0.0f, 1.925f, 0.0f, 1.0f), XMVectorSet(0.25f, 0.25f, 0.25f, 1.0f), XMVectorSet(0.75f, 0.75f, 0.75f, 1.0f), XMVectorSet(0.4f, 0.4f, 0.4f, 1.0f)}};
 
+		const material& surface = materials.at(p.material_id);
+
 		XMVECTOR output = XMVectorZero();
 		for (const light& l: lights)
 		{
@@ -334,12 +865,12 @@ namespace cg::renderer
 			const XMVECTOR incidentDir = XMVectorScale(lightDir, -1.0f);
 			const XMVECTOR reflectedLightDir = XMVector3Reflect(incidentDir, surfaceNormal);
 			const XMVECTOR cameraDir = XMVector3Normalize(XMVectorSubtract(camera_ray.position, address));
-			XMVECTOR shininess = XMVectorReplicate(p.point.shininess);
+			XMVECTOR shininess = XMVectorReplicate(surface.shininess);
 			XMVECTOR shadow = XMVectorSplatOne();
 
 			if (USE_AMBIENT)
 			{
-				const XMVECTOR materialAmbient = XMLoadFloat3(&p.point.ambient);
+				const XMVECTOR materialAmbient = XMLoadFloat3(&surface.ambient);
 				const XMVECTOR ambientComponent = XMColorModulate(l.ambient, materialAmbient);
 				output = XMVectorAdd(output, ambientComponent);
 			}
@@ -350,9 +881,7 @@ namespace cg::renderer
 			}
 
 			ray lightRay(address, lightDir);
-			payload shadowPayload;
-			const bool bIsShadow = trace_ray(lightRay, XMVectorGetX(XMVector3Length(lightVector)), 0.0001f,
-											 shadowPayload, true);
+			const bool bIsShadow = occluded(lightRay, 0.0001f, XMVectorGetX(XMVector3Length(lightVector)));
 			if (bIsShadow)
 			{
 				shadow = XMVectorReplicate(0.5f);
@@ -360,7 +889,7 @@ namespace cg::renderer
 
 			if (USE_DIFFUSE)
 			{
-				const XMVECTOR materialDiffuse = XMLoadFloat3(&p.point.diffuse);
+				const XMVECTOR materialDiffuse = XMLoadFloat3(&surface.diffuse);
 				XMVECTOR diffuseComponent = XMVectorDotAbsolute(lightDir, surfaceNormal);
 				diffuseComponent = XMColorModulate(diffuseComponent, l.duffuse);
 				diffuseComponent = XMColorModulate(diffuseComponent, shadow);
@@ -403,27 +932,6 @@ namespace cg::renderer
 	template<typename VB, typename RT>
 	DirectX::XMFLOAT2 raytracer<VB, RT>::get_jitter(size_t frame_id)
 	{
-		DirectX::XMFLOAT2 result(0.0f, 0.0f);
-		constexpr int base_x = 2;
-		int index = static_cast<int>(frame_id) + 1;
-		float inv_base = 1.0f / base_x;
-		float fraction = inv_base;
-		while (index > 0)
-		{
-			result.x += (index % base_x) * fraction;
-			index /= base_x;
-			fraction *= inv_base;
-		}
-		constexpr int base_y = 3;
-		index = static_cast<int>(frame_id) + 1;
-		inv_base = 1.0f / base_y;
-		fraction = inv_base;
-		while (index > 0)
-		{
-			result.y += index % base_y * fraction;
-			index /= base_y;
-			fraction *= inv_base;
-		}
-		return result;
+		return DirectX::XMFLOAT2(utils::halton(frame_id + 1, 2), utils::halton(frame_id + 1, 3));
 	}
 }// namespace cg::renderer
\ No newline at end of file
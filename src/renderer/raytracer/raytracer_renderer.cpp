@@ -17,15 +17,21 @@ void cg::renderer::ray_tracing_renderer::init()
 	camera->set_z_near(settings->camera_z_near);
 	camera->set_z_far(settings->camera_z_far);
 
-	render_target = std::make_shared<resource<unsigned_color>>(settings->width, settings->height);
+	render_target = std::make_shared<resource<unsigned_color>>(get_render_width(), get_render_height());
 
 	model = std::make_shared<world::model>();
 	model->load_obj(settings->model_path);
 
-	ray_tracer = std::make_shared<raytracer<vertex, unsigned_color>>();
-	ray_tracer->set_viewport(settings->width, settings->height);
-	ray_tracer->set_render_target(render_target);
-	ray_tracer->set_camera(camera);
+	ray_tracer = std::make_shared<raytracer<compact_vertex, unsigned_color>>();
+	setup_tracer(*ray_tracer, render_target);
+
+	// Keeps rebuilding from scratch what ray_tracer refits, so the refit chain itself stays untouched
+	if (settings->debug_incremental)
+	{
+		reference_target = std::make_shared<resource<unsigned_color>>(get_render_width(), get_render_height());
+		reference_tracer = std::make_shared<raytracer<compact_vertex, unsigned_color>>();
+		setup_tracer(*reference_tracer, reference_target);
+	}
 }
 
 void cg::renderer::ray_tracing_renderer::destroy()
@@ -34,23 +40,93 @@ void cg::renderer::ray_tracing_renderer::destroy()
 
 void cg::renderer::ray_tracing_renderer::update()
 {
+	if (settings->animated_shape >= model->get_vertex_buffers().size())
+	{
+		THROW_ERROR("animated_shape is out of range");
+	}
+	model->rotate_shape(settings->animated_shape, DirectX::XMConvertToRadians(settings->animation_angle));
+	ray_tracer->set_vertex_quantizations(model->get_vertex_quantizations());
+	ray_tracer->update_acceleration_structure();
 }
 
 void cg::renderer::ray_tracing_renderer::render()
+{
+	set_scene(*ray_tracer);
+	ray_tracer->build_acceleration_structure();
+	render_frames(*ray_tracer);
+
+	for (size_t step = 0; step != settings->animation_frames; ++step)
+	{
+		std::cerr << "Rendering animation frame " << step << "...\r" << std::flush;
+		update();
+		render_frames(*ray_tracer);
+		if (settings->debug_incremental)
+		{
+			check_refit_frame();
+		}
+	}
+	save_result(*render_target);
+}
+
+void cg::renderer::ray_tracing_renderer::setup_tracer(raytracer<compact_vertex, unsigned_color>& tracer, std::shared_ptr<resource<unsigned_color>> target)
+{
+	tracer.set_viewport(get_render_width(), get_render_height());
+	tracer.set_render_target(target);
+	tracer.set_camera(camera);
+	tracer.set_num_threads(settings->raytracing_threads);
+	tracer.set_packet_tracing(settings->raytracing_packets);
+}
+
+void cg::renderer::ray_tracing_renderer::set_scene(raytracer<compact_vertex, unsigned_color>& tracer)
 {
 	auto& vertexBuffers = model->get_vertex_buffers();
 	auto& indexBuffers = model->get_index_buffers();
 
-	ray_tracer->set_vertex_buffers(vertexBuffers);
-	ray_tracer->set_index_buffers(indexBuffers);
+	tracer.set_vertex_buffers(vertexBuffers);
+	tracer.set_vertex_quantizations(model->get_vertex_quantizations());
+	tracer.set_index_buffers(indexBuffers);
+	tracer.set_materials(model->get_materials());
+	tracer.set_material_id_buffers(model->get_material_id_buffers());
 
-	ray_tracer->build_acceleration_structure();
+	// Every shape of the model is placed once with the model's world matrix and has a bottom level of its own
+	DirectX::XMFLOAT4X4 world;
+	DirectX::XMStoreFloat4x4(&world, model->get_world_matrix());
+	std::vector<instance> instances;
+	for (size_t shapeIdx = 0; shapeIdx != vertexBuffers.size(); ++shapeIdx)
+	{
+		instances.push_back({world, static_cast<uint32_t>(shapeIdx)});
+	}
+	tracer.set_instances(instances);
+}
 
+void cg::renderer::ray_tracing_renderer::render_frames(raytracer<compact_vertex, unsigned_color>& tracer)
+{
 	for (size_t frame = 0; frame != 10; ++frame)
 	{
 		std::cerr << "Rendering frame " << frame << "...\r" << std::flush;
-		ray_tracer->clear_render_target();
-		ray_tracer->launch_ray_generation(frame);
+		tracer.clear_render_target();
+		tracer.launch_ray_generation(frame);
+	}
+}
+
+void cg::renderer::ray_tracing_renderer::check_refit_frame()
+{
+	set_scene(*reference_tracer);
+	reference_tracer->build_acceleration_structure();
+	render_frames(*reference_tracer);
+
+	size_t numDifferent = 0;
+	for (size_t i = 0; i != render_target->get_number_of_elements(); ++i)
+	{
+		const unsigned_color& a = render_target->item(i);
+		const unsigned_color& b = reference_target->item(i);
+		if (a.r != b.r || a.g != b.g || a.b != b.b)
+		{
+			++numDifferent;
+		}
 	}
-	utils::save_resource(*render_target, settings->result_path);
-}
\ No newline at end of file
+	if (numDifferent != 0)
+	{
+		THROW_ERROR("Frame traced through a refitted acceleration structure differs from a rebuilt one in " + std::to_string(numDifferent) + " pixels");
+	}
+}
@@ -11,6 +11,7 @@ namespace cg::renderer
 		virtual void init();
 		virtual void destroy();
 
+		// Turns the animated shape by one animation step and refits the acceleration structure around it
 		virtual void update();
 		virtual void render();
 
@@ -19,9 +20,18 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::world::model> model;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> ray_tracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>> ray_tracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>> shadow_raytracer;
+		// Renders each animation frame over a fresh build to check the refitted one against
+		std::shared_ptr<cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>> reference_tracer;
+		std::shared_ptr<cg::resource<cg::unsigned_color>> reference_target;
 
 		std::vector<cg::renderer::light> lights;
+
+		void setup_tracer(cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>& tracer, std::shared_ptr<cg::resource<cg::unsigned_color>> target);
+		void set_scene(cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>& tracer);
+		void render_frames(cg::renderer::raytracer<cg::compact_vertex, cg::unsigned_color>& tracer);
+		// Fails when the frame traced through the refitted structure differs from the reference build
+		void check_refit_frame();
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "DirectXMath.h"
+
+#include <cmath>
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace cg::renderer
+{
+	// Eight triangles in structure of arrays layout for the 8-wide Moller-Trumbore kernel.
+	// Unused lanes keep zero edges, which never report a hit.
+	struct alignas(32) triangle_packet
+	{
+		static constexpr size_t width = 8;
+
+		float v0_x[width];
+		float v0_y[width];
+		float v0_z[width];
+		float edge1_x[width];
+		float edge1_y[width];
+		float edge1_z[width];
+		float edge2_x[width];
+		float edge2_y[width];
+		float edge2_z[width];
+		uint32_t primitive[width];
+
+		// Lane of the nearest hit within [min_t, max_t] and its distance and barycentrics, -1 on a miss.
+		// Equally near lanes resolve to the lower primitive, whatever the lane order.
+		int intersect(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t,
+					  float& t, float& u, float& v) const;
+		// Whether any lane is hit within [min_t, max_t]
+		bool occludes(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t) const;
+
+	protected:
+		// Bit mask of the lanes hit within [min_t, max_t], with every lane's distance and barycentrics
+		int intersect_lanes(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t,
+							float* lane_t, float* lane_u, float* lane_v) const;
+	};
+
+	inline int triangle_packet::intersect(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t,
+										  float& t, float& u, float& v) const
+	{
+		alignas(32) float lane_t[width];
+		alignas(32) float lane_u[width];
+		alignas(32) float lane_v[width];
+		const int hits = intersect_lanes(origin, direction, min_t, max_t, lane_t, lane_u, lane_v);
+
+		int nearest = -1;
+		for (int lane = 0; hits != 0 && lane != static_cast<int>(width); ++lane)
+		{
+			if ((hits >> lane & 1) && (nearest < 0 || lane_t[lane] < t || (lane_t[lane] == t && primitive[lane] < primitive[nearest])))
+			{
+				nearest = lane;
+				t = lane_t[lane];
+				u = lane_u[lane];
+				v = lane_v[lane];
+			}
+		}
+		return nearest;
+	}
+
+	inline bool triangle_packet::occludes(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t) const
+	{
+		alignas(32) float lane_t[width];
+		alignas(32) float lane_u[width];
+		alignas(32) float lane_v[width];
+		return intersect_lanes(origin, direction, min_t, max_t, lane_t, lane_u, lane_v) != 0;
+	}
+
+	inline int triangle_packet::intersect_lanes(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction, float min_t, float max_t,
+												float* lane_t, float* lane_u, float* lane_v) const
+	{
+		constexpr float epsilon = 1e-12f;
+
+#ifdef __AVX2__
+		const __m256 dx = _mm256_set1_ps(direction.x);
+		const __m256 dy = _mm256_set1_ps(direction.y);
+		const __m256 dz = _mm256_set1_ps(direction.z);
+		const __m256 e1x = _mm256_load_ps(edge1_x);
+		const __m256 e1y = _mm256_load_ps(edge1_y);
+		const __m256 e1z = _mm256_load_ps(edge1_z);
+		const __m256 e2x = _mm256_load_ps(edge2_x);
+		const __m256 e2y = _mm256_load_ps(edge2_y);
+		const __m256 e2z = _mm256_load_ps(edge2_z);
+
+		const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		const __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		const __m256 inverse_determinant = _mm256_div_ps(_mm256_set1_ps(1.0f), determinant);
+
+		const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_load_ps(v0_x));
+		const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_load_ps(v0_y));
+		const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_load_ps(v0_z));
+		const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inverse_determinant);
+
+		const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+		const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverse_determinant);
+		const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inverse_determinant);
+
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 absolute_determinant = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), determinant);
+		__m256 mask = _mm256_cmp_ps(absolute_determinant, _mm256_set1_ps(epsilon), _CMP_GE_OQ);
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(min_t), _CMP_GE_OQ));
+		mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(max_t), _CMP_LE_OQ));
+
+		const int hits = _mm256_movemask_ps(mask);
+		if (hits != 0)
+		{
+			_mm256_store_ps(lane_t, t);
+			_mm256_store_ps(lane_u, u);
+			_mm256_store_ps(lane_v, v);
+		}
+		return hits;
+#else
+		int hits = 0;
+		for (int lane = 0; lane != static_cast<int>(width); ++lane)
+		{
+			const float px = direction.y * edge2_z[lane] - direction.z * edge2_y[lane];
+			const float py = direction.z * edge2_x[lane] - direction.x * edge2_z[lane];
+			const float pz = direction.x * edge2_y[lane] - direction.y * edge2_x[lane];
+			const float determinant = edge1_x[lane] * px + edge1_y[lane] * py + edge1_z[lane] * pz;
+			if (std::abs(determinant) < epsilon)
+			{
+				continue;
+			}
+			const float inverse_determinant = 1.0f / determinant;
+
+			const float sx = origin.x - v0_x[lane];
+			const float sy = origin.y - v0_y[lane];
+			const float sz = origin.z - v0_z[lane];
+			const float u = (sx * px + sy * py + sz * pz) * inverse_determinant;
+			if (u < 0.0f || u > 1.0f)
+			{
+				continue;
+			}
+
+			const float qx = sy * edge1_z[lane] - sz * edge1_y[lane];
+			const float qy = sz * edge1_x[lane] - sx * edge1_z[lane];
+			const float qz = sx * edge1_y[lane] - sy * edge1_x[lane];
+			const float v = (direction.x * qx + direction.y * qy + direction.z * qz) * inverse_determinant;
+			if (v < 0.0f || u + v > 1.0f)
+			{
+				continue;
+			}
+
+			const float t = (edge2_x[lane] * qx + edge2_y[lane] * qy + edge2_z[lane] * qz) * inverse_determinant;
+			if (t >= min_t && t <= max_t)
+			{
+				hits |= 1 << lane;
+				lane_t[lane] = t;
+				lane_u[lane] = u;
+				lane_v[lane] = v;
+			}
+		}
+		return hits;
+#endif
+	}
+}// namespace cg::renderer
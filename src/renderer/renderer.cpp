@@ -1,6 +1,11 @@
 #include "renderer.h"
 
 #include "utils/error_handler.h"
+#include "utils/resource_utils.h"
+#include "utils/upscaler.h"
+
+#include <algorithm>
+#include <cmath>
 
 #ifdef RASTERIZATION
 #include "renderer/rasterizer/rasterizer_renderer.h"
@@ -32,6 +37,28 @@ unsigned cg::renderer::renderer::get_width()
 	return settings->width;
 }
 
+unsigned cg::renderer::renderer::get_render_height() const
+{
+	return std::max(1u, static_cast<unsigned>(std::lround(settings->height * settings->render_scale)));
+}
+
+unsigned cg::renderer::renderer::get_render_width() const
+{
+	return std::max(1u, static_cast<unsigned>(std::lround(settings->width * settings->render_scale)));
+}
+
+void cg::renderer::renderer::save_result(cg::resource<cg::unsigned_color>& image)
+{
+	if (image.get_stride() == get_width() && image.get_number_of_elements() == get_width() * get_height()) {
+		utils::save_resource(image, settings->result_path);
+		return;
+	}
+
+	cg::resource<cg::unsigned_color> output(get_width(), get_height());
+	utils::upscale(image, output, settings->sharpness);
+	utils::save_resource(output, settings->result_path);
+}
+
 
 std::shared_ptr<renderer> cg::renderer::make_renderer(std::shared_ptr<cg::settings> settings)
 {
@@ -15,6 +15,10 @@ namespace cg::renderer
 		unsigned get_height();
 		unsigned get_width();
 
+		// Internal resolution, which render_scale may reduce below the output size
+		unsigned get_render_height() const;
+		unsigned get_render_width() const;
+
 		virtual void init() = 0;
 		virtual void destroy() = 0;
 
@@ -35,6 +39,9 @@ namespace cg::renderer
 
 		std::shared_ptr<cg::world::camera> camera;
 		std::shared_ptr<cg::world::model> model;
+
+		// Upscales the image to the output size if needed and writes it to result_path
+		void save_result(cg::resource<cg::unsigned_color>& image);
 	};
 
 
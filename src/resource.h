@@ -3,8 +3,12 @@
 #include "utils/error_handler.h"
 
 #include "DirectXMath.h"
+#include "DirectXPackedVector.h"
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <linalg.h>
+#include <memory>
 #include <vector>
 
 
@@ -23,6 +27,8 @@ namespace cg
 		const T* get_data();
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
+		const T& item(size_t item) const;
+		const T& item(size_t x, size_t y) const;
 
 		size_t get_size_in_bytes() const;
 		size_t get_number_of_elements() const;
@@ -62,6 +68,16 @@ namespace cg
 		return data.at(y * stride + x);
 	}
 	template<typename T>
+	inline const T& resource<T>::item(size_t item) const
+	{
+		return data.at(item);
+	}
+	template<typename T>
+	inline const T& resource<T>::item(size_t x, size_t y) const
+	{
+		return data.at(y * stride + x);
+	}
+	template<typename T>
 	inline size_t resource<T>::get_size_in_bytes() const
 	{
 		return get_number_of_elements() * sizeof(T);
@@ -155,14 +171,6 @@ namespace cg
 		DirectX::XMFLOAT3 position;
 		DirectX::XMFLOAT3 normal;
 
-		DirectX::XMFLOAT3 ambient;
-		DirectX::XMFLOAT3 diffuse;
-		DirectX::XMFLOAT3 specular;
-
-		DirectX::XMFLOAT3 emissive;
-
-		float shininess;
-
 		DirectX::XMFLOAT2 uv;
 
 		vertex operator+(const vertex& other) const
@@ -176,20 +184,6 @@ namespace cg
 			converter = XMVectorAdd(XMLoadFloat3(&normal), XMLoadFloat3(&other.normal));
 			XMStoreFloat3(&result.normal, converter);
 
-			converter = XMVectorAdd(XMLoadFloat3(&ambient), XMLoadFloat3(&other.ambient));
-			XMStoreFloat3(&result.ambient, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&diffuse), XMLoadFloat3(&other.diffuse));
-			XMStoreFloat3(&result.diffuse, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&specular), XMLoadFloat3(&other.specular));
-			XMStoreFloat3(&result.specular, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&emissive), XMLoadFloat3(&other.emissive));
-			XMStoreFloat3(&result.emissive, converter);
-
-			result.shininess = shininess + other.shininess;
-
 			converter = XMVectorAdd(XMLoadFloat2(&uv), XMLoadFloat2(&other.uv));
 			XMStoreFloat2(&result.uv, converter);
 
@@ -207,25 +201,168 @@ namespace cg
 			converter = XMVectorScale(XMLoadFloat3(&normal), value);
 			XMStoreFloat3(&result.normal, converter);
 
-			converter = XMVectorScale(XMLoadFloat3(&ambient), value);
-			XMStoreFloat3(&result.ambient, converter);
+			converter = XMVectorScale(XMLoadFloat2(&uv), value);
+			XMStoreFloat2(&result.uv, converter);
+
+			return result;
+		}
+	};
 
-			converter = XMVectorScale(XMLoadFloat3(&diffuse), value);
-			XMStoreFloat3(&result.diffuse, converter);
+	// Shared by all triangles referencing it through their material id
+	struct material
+	{
+		DirectX::XMFLOAT3 ambient;
+		DirectX::XMFLOAT3 diffuse;
+		DirectX::XMFLOAT3 specular;
 
-			converter = XMVectorScale(XMLoadFloat3(&specular), value);
-			XMStoreFloat3(&result.specular, converter);
+		DirectX::XMFLOAT3 emissive;
 
-			converter = XMVectorScale(XMLoadFloat3(&emissive), value);
-			XMStoreFloat3(&result.emissive, converter);
+		float shininess;
+	};
 
-			result.shininess = shininess * value;
+	inline DirectX::XMFLOAT2 encode_octahedral(const DirectX::XMFLOAT3& normal)
+	{
+		const float l1_norm = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+		if (l1_norm == 0.0f) {
+			return {0.0f, 0.0f};
+		}
 
-			converter = XMVectorScale(XMLoadFloat2(&uv), value);
-			XMStoreFloat2(&result.uv, converter);
+		float x = normal.x / l1_norm;
+		float y = normal.y / l1_norm;
+		if (normal.z < 0.0f) {
+			const float folded_x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			const float folded_y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = folded_x;
+			y = folded_y;
+		}
+		return {x, y};
+	}
+
+	inline DirectX::XMFLOAT3 decode_octahedral(const DirectX::XMFLOAT2& encoded)
+	{
+		DirectX::XMFLOAT3 normal{encoded.x, encoded.y, 1.0f - std::abs(encoded.x) - std::abs(encoded.y)};
+		const float fold = std::max(-normal.z, 0.0f);
+		normal.x += normal.x >= 0.0f ? -fold : fold;
+		normal.y += normal.y >= 0.0f ? -fold : fold;
+
+		DirectX::XMStoreFloat3(&normal, DirectX::XMVector3Normalize(DirectX::XMLoadFloat3(&normal)));
+		return normal;
+	}
+
+	// Maps 16-bit quantized positions back into the bounds of a shape
+	struct vertex_quantization
+	{
+		static vertex_quantization from_bounds(const DirectX::XMFLOAT3& min, const DirectX::XMFLOAT3& max)
+		{
+			constexpr float steps = 65535.0f;
+			return {min, {(max.x - min.x) / steps, (max.y - min.y) / steps, (max.z - min.z) / steps}};
+		}
+
+		DirectX::XMFLOAT3 get_min() const
+		{
+			return offset;
+		}
+
+		DirectX::XMFLOAT3 get_max() const
+		{
+			return {offset.x + 65535.0f * scale.x, offset.y + 65535.0f * scale.y, offset.z + 65535.0f * scale.z};
+		}
+
+		DirectX::XMFLOAT3 offset;
+		DirectX::XMFLOAT3 scale;
+	};
+
+	struct compact_vertex
+	{
+		static compact_vertex encode(const vertex& in, const vertex_quantization& quantization)
+		{
+			using namespace DirectX;
+			using namespace DirectX::PackedVector;
+
+			compact_vertex result;
+
+			// Flat axes have zero scale and always quantize to zero
+			auto inverse = [](float scale) { return scale > 0.0f ? 1.0f / scale : 0.0f; };
+			const XMVECTOR inverse_scale = XMVectorSet(inverse(quantization.scale.x), inverse(quantization.scale.y), inverse(quantization.scale.z), 0.0f);
+			XMVECTOR quantized = XMVectorMultiply(
+					XMVectorSubtract(XMLoadFloat3(&in.position), XMLoadFloat3(&quantization.offset)),
+					inverse_scale);
+			quantized = XMVectorRound(XMVectorClamp(quantized, XMVectorZero(), XMVectorReplicate(65535.0f)));
+			result.position[0] = static_cast<uint16_t>(XMVectorGetX(quantized));
+			result.position[1] = static_cast<uint16_t>(XMVectorGetY(quantized));
+			result.position[2] = static_cast<uint16_t>(XMVectorGetZ(quantized));
+
+			const XMFLOAT2 octahedral = encode_octahedral(in.normal);
+			XMStoreShortN2(&result.normal, XMLoadFloat2(&octahedral));
+			XMStoreHalf2(&result.uv, XMLoadFloat2(&in.uv));
+
+			return result;
+		}
+
+		vertex decode(const vertex_quantization& quantization) const
+		{
+			using namespace DirectX;
+			using namespace DirectX::PackedVector;
+
+			vertex result;
+
+			const XMVECTOR quantized = XMVectorSet(position[0], position[1], position[2], 0.0f);
+			XMStoreFloat3(&result.position, XMVectorMultiplyAdd(quantized, XMLoadFloat3(&quantization.scale), XMLoadFloat3(&quantization.offset)));
+
+			XMFLOAT2 octahedral;
+			XMStoreFloat2(&octahedral, XMLoadShortN2(&normal));
+			result.normal = decode_octahedral(octahedral);
+			XMStoreFloat2(&result.uv, XMLoadHalf2(&uv));
 
 			return result;
 		}
+
+		uint16_t position[3];
+		DirectX::PackedVector::XMSHORTN2 normal;
+		DirectX::PackedVector::XMHALF2 uv;
+	};
+
+	// Shapes with at most 65536 vertices store 16-bit indices, larger ones 32-bit
+	struct compact_index_buffer
+	{
+		compact_index_buffer() = default;
+		compact_index_buffer(size_t num_indices, size_t num_vertices)
+		{
+			if (num_vertices <= 65536) {
+				indices16 = std::make_shared<resource<uint16_t>>(num_indices);
+			}
+			else {
+				indices32 = std::make_shared<resource<unsigned int>>(num_indices);
+			}
+		}
+
+		unsigned int item(size_t i) const
+		{
+			return indices16 ? indices16->item(i) : indices32->item(i);
+		}
+
+		void set_item(size_t i, unsigned int index)
+		{
+			if (indices16) {
+				indices16->item(i) = static_cast<uint16_t>(index);
+			}
+			else {
+				indices32->item(i) = index;
+			}
+		}
+
+		size_t get_number_of_elements() const
+		{
+			return indices16 ? indices16->get_number_of_elements() : indices32->get_number_of_elements();
+		}
+
+		size_t get_size_in_bytes() const
+		{
+			return indices16 ? indices16->get_size_in_bytes() : indices32->get_size_in_bytes();
+		}
+
+		std::shared_ptr<resource<uint16_t>> indices16;
+		std::shared_ptr<resource<unsigned int>> indices32;
 	};
 
 }// namespace cg
\ No newline at end of file
@@ -24,7 +24,31 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("raytracing_threads", "Raytracer worker threads, 0 uses every core", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("raytracing_packets", "Trace raytracer primary rays in 8x8 packets", cxxopts::value<bool>()->default_value("true"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("light_position", "Shadow casting light position", cxxopts::value<std::vector<float>>()->default_value("0.0,1.925,0.0"));
+	add_options("shadow_map_resolution", "Shadow map width and height", cxxopts::value<unsigned>()->default_value("2048"));
+	add_options("render_scale", "Fraction of the output resolution rendered internally, then upscaled", cxxopts::value<float>()->default_value("1.0"));
+	add_options("sharpness", "Upscaler sharpening in stops, 0 is the strongest", cxxopts::value<float>()->default_value("0.2"));
+	add_options("taa", "Jitter and temporally resolve rasterizer frames when accumulating several", cxxopts::value<bool>()->default_value("true"));
+	add_options("ssao", "Enable screen-space ambient occlusion in the rasterizer", cxxopts::value<bool>()->default_value("false"));
+	add_options("ssao_resolution_divider", "Ambient occlusion is computed at 1/N of the output resolution", cxxopts::value<unsigned>()->default_value("2"));
+	add_options("ssao_radius", "World space sampling radius of the ambient occlusion", cxxopts::value<float>()->default_value("0.1"));
+	add_options("ssr", "Enable screen-space reflections of specular materials in the rasterizer", cxxopts::value<bool>()->default_value("false"));
+	add_options("ssr_environment_color", "Reflected colour where screen-space reflection rays miss", cxxopts::value<std::vector<float>>()->default_value("0.0,0.0,0.0"));
+	add_options("num_random_lights", "Number of point lights scattered over the model", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("random_light_range", "Range of the scattered point lights", cxxopts::value<float>()->default_value("0.5"));
+	add_options("shading_rate_mode", "Rasterizer variable-rate shading: off, periphery or contrast", cxxopts::value<std::string>()->default_value("off"));
+	add_options("quad_shading", "Shade 2x2 pixel quads together, widening shadow filtering to their derivative footprint", cxxopts::value<bool>()->default_value("false"));
+	add_options("front_to_back", "Sort rasterizer draws front to back", cxxopts::value<bool>()->default_value("true"));
+	add_options("sort_last_workers", "Rasterizer threads drawing separate clusters before depth compositing, 0 or 1 is off", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("draw_cluster_size", "Triangles per sorted draw cluster, 0 to sort whole shapes", cxxopts::value<unsigned>()->default_value("512"));
+	add_options("debug_overdraw", "Print rasterizer statistics and save an overdraw heatmap", cxxopts::value<bool>()->default_value("false"));
+	add_options("debug_incremental", "Check every animation frame rendered from damaged tiles or a refitted BVH against a full redraw or rebuild, failing on a mismatch", cxxopts::value<bool>()->default_value("false"));
+	add_options("animation_frames", "Frames rendered after the first one while animated_shape turns about its centre", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("animated_shape", "Index of the shape that moves during the animation", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("animation_angle", "Degrees the animated shape turns per animation frame", cxxopts::value<float>()->default_value("5.0"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -45,7 +69,44 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_z_far = result["camera_z_far"].as<float>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
+	settings->raytracing_threads = result["raytracing_threads"].as<unsigned>();
+	settings->raytracing_packets = result["raytracing_packets"].as<bool>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->light_position = result["light_position"].as<std::vector<float>>();
+	settings->shadow_map_resolution = result["shadow_map_resolution"].as<unsigned>();
+	settings->render_scale = result["render_scale"].as<float>();
+	settings->sharpness = result["sharpness"].as<float>();
+	settings->taa = result["taa"].as<bool>();
+	settings->ssao = result["ssao"].as<bool>();
+	settings->ssao_resolution_divider = result["ssao_resolution_divider"].as<unsigned>();
+	settings->ssao_radius = result["ssao_radius"].as<float>();
+	settings->ssr = result["ssr"].as<bool>();
+	settings->ssr_environment_color = result["ssr_environment_color"].as<std::vector<float>>();
+	settings->num_random_lights = result["num_random_lights"].as<unsigned>();
+	settings->random_light_range = result["random_light_range"].as<float>();
+	settings->quad_shading = result["quad_shading"].as<bool>();
+	settings->shading_rate_mode = result["shading_rate_mode"].as<std::string>();
+	settings->front_to_back = result["front_to_back"].as<bool>();
+	settings->sort_last_workers = result["sort_last_workers"].as<unsigned>();
+	settings->draw_cluster_size = result["draw_cluster_size"].as<unsigned>();
+	settings->debug_overdraw = result["debug_overdraw"].as<bool>();
+	settings->debug_incremental = result["debug_incremental"].as<bool>();
+	settings->animation_frames = result["animation_frames"].as<unsigned>();
+	settings->animated_shape = result["animated_shape"].as<unsigned>();
+	settings->animation_angle = result["animation_angle"].as<float>();
+
+	if (settings->render_scale <= 0.0f || settings->render_scale > 1.0f) {
+		THROW_ERROR("render_scale should be in (0, 1]");
+	}
+	if (settings->shading_rate_mode != "off" && settings->shading_rate_mode != "periphery" && settings->shading_rate_mode != "contrast") {
+		THROW_ERROR("Unknown shading_rate_mode");
+	}
+	if (settings->light_position.size() != 3) {
+		THROW_ERROR("light_position should have three components");
+	}
+	if (settings->ssr_environment_color.size() != 3) {
+		THROW_ERROR("ssr_environment_color should have three components");
+	}
 
 	return settings;
 }
\ No newline at end of file
@@ -26,7 +26,38 @@ namespace cg
 		std::filesystem::path result_path;
 
 		unsigned raytracing_depth;
+		unsigned raytracing_threads;
+		bool raytracing_packets;
 		unsigned accumulation_num;
+
+		std::vector<float> light_position;
+		unsigned shadow_map_resolution;
+
+		float render_scale;
+		float sharpness;
+
+		bool taa;
+
+		bool ssao;
+		unsigned ssao_resolution_divider;
+		float ssao_radius;
+		bool ssr;
+		std::vector<float> ssr_environment_color;
+
+		unsigned num_random_lights;
+		float random_light_range;
+
+		bool quad_shading;
+		std::string shading_rate_mode;
+		bool front_to_back;
+		unsigned sort_last_workers;
+		unsigned draw_cluster_size;
+		bool debug_overdraw;
+		bool debug_incremental;
+
+		unsigned animation_frames;
+		unsigned animated_shape;
+		float animation_angle;
 	};
 
 }// namespace cg
\ No newline at end of file
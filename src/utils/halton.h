@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+
+namespace cg::utils
+{
+	// Radical inverse of index in the given base, the building block of Halton sequences
+	inline float halton(size_t index, int base)
+	{
+		float result = 0.0f;
+		const float inv_base = 1.0f / static_cast<float>(base);
+		float fraction = inv_base;
+		while (index > 0) {
+			result += static_cast<float>(index % base) * fraction;
+			index /= base;
+			fraction *= inv_base;
+		}
+		return result;
+	}
+}// namespace cg::utils
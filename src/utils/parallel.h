@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Splits a width x height image into square tiles and hands them out to worker threads
+	// through a shared counter, so uneven tiles balance themselves. 0 threads means one per core.
+	inline void parallel_for_tiles(size_t width, size_t height, size_t tile_size,
+								   const std::function<void(size_t x_begin, size_t y_begin, size_t x_end, size_t y_end)>& kernel,
+								   unsigned int num_threads = 0)
+	{
+		const size_t tiles_x = (width + tile_size - 1) / tile_size;
+		const size_t tiles_y = (height + tile_size - 1) / tile_size;
+		const size_t num_tiles = tiles_x * tiles_y;
+
+		if (num_threads == 0) {
+			num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+		num_threads = static_cast<unsigned int>(std::min<size_t>(num_threads, num_tiles));
+
+		std::atomic<size_t> next_tile{0};
+		auto worker = [&]() {
+			for (size_t tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+				const size_t x_begin = (tile % tiles_x) * tile_size;
+				const size_t y_begin = (tile / tiles_x) * tile_size;
+				kernel(x_begin, y_begin, std::min(x_begin + tile_size, width), std::min(y_begin + tile_size, height));
+			}
+		};
+
+		if (num_threads <= 1) {
+			worker();
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		threads.reserve(num_threads - 1);
+		for (unsigned int i = 1; i != num_threads; ++i) {
+			threads.emplace_back(worker);
+		}
+		worker();
+		for (std::thread& thread: threads) {
+			thread.join();
+		}
+	}
+}// namespace cg::utils
@@ -7,6 +7,9 @@
 
 #include <stb_image_write.h>
 
+#include <algorithm>
+#include <cmath>
+
 
 using namespace cg::utils;
 
@@ -28,3 +31,38 @@ void cg::utils::save_resource(
 
 	std::system(view_command.c_str());
 }
+
+void cg::utils::save_heatmap(cg::resource<unsigned int>& counters, std::filesystem::path filepath)
+{
+	const size_t width = counters.get_stride();
+	const size_t height = counters.get_number_of_elements() / width;
+
+	unsigned int max_count = 1;
+	for (size_t i = 0; i != counters.get_number_of_elements(); ++i) {
+		max_count = std::max(max_count, counters.item(i));
+	}
+
+	// Black for untouched pixels, then blue -> green -> red as the count approaches the maximum
+	cg::resource<cg::unsigned_color> heatmap(width, height);
+	for (size_t i = 0; i != counters.get_number_of_elements(); ++i) {
+		const unsigned int count = counters.item(i);
+		if (count == 0) {
+			heatmap.item(i) = cg::unsigned_color{0, 0, 0};
+			continue;
+		}
+		const float t = static_cast<float>(count) / static_cast<float>(max_count);
+		heatmap.item(i) = cg::unsigned_color::from_float3({
+				std::clamp(2.0f * t - 1.0f, 0.0f, 1.0f),
+				1.0f - std::abs(2.0f * t - 1.0f),
+				std::clamp(1.0f - 2.0f * t, 0.0f, 1.0f)});
+	}
+
+	save_resource(heatmap, filepath);
+}
+
+std::filesystem::path cg::utils::get_debug_path(const std::filesystem::path& result_path, const std::string& suffix)
+{
+	std::filesystem::path debug_path = result_path;
+	debug_path.replace_filename(result_path.stem().string() + "_" + suffix + result_path.extension().string());
+	return debug_path;
+}
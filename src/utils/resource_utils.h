@@ -8,4 +8,8 @@
 namespace cg::utils
 {
 	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+
+	void save_heatmap(cg::resource<unsigned int>& counters, std::filesystem::path filepath);
+
+	std::filesystem::path get_debug_path(const std::filesystem::path& result_path, const std::string& suffix);
 }
\ No newline at end of file
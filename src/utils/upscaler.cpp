@@ -0,0 +1,156 @@
+#include "upscaler.h"
+
+#include "utils/parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+
+namespace
+{
+	constexpr size_t tile_size = 64;
+
+	float luma(const float3& color)
+	{
+		return color.y + 0.5f * (color.x + color.z);
+	}
+
+	// Lanczos-2 approximation of EASU, the lobe narrows as the edge gets stronger
+	float easu_weight(float2 offset, float2 direction, float2 stretch, float lobe, float clip)
+	{
+		float2 rotated{offset.x * direction.x + offset.y * direction.y, offset.y * direction.x - offset.x * direction.y};
+		rotated *= stretch;
+		const float distance2 = std::min(rotated.x * rotated.x + rotated.y * rotated.y, clip);
+
+		float base = 2.0f / 5.0f * distance2 - 1.0f;
+		float window = lobe * distance2 - 1.0f;
+		base *= base;
+		window *= window;
+		base = 25.0f / 16.0f * base - (25.0f / 16.0f - 1.0f);
+		return base * window;
+	}
+}// namespace
+
+void cg::utils::upscale(const cg::resource<cg::unsigned_color>& source, cg::resource<cg::unsigned_color>& destination, float sharpness)
+{
+	const int source_width = static_cast<int>(source.get_stride());
+	const int source_height = static_cast<int>(source.get_number_of_elements() / source.get_stride());
+	const size_t width = destination.get_stride();
+	const size_t height = destination.get_number_of_elements() / width;
+
+	auto fetch = [&](int x, int y) {
+		return source.item(static_cast<size_t>(std::clamp(x, 0, source_width - 1)),
+						   static_cast<size_t>(std::clamp(y, 0, source_height - 1)))
+				.to_float3();
+	};
+
+	const float scale_x = static_cast<float>(source_width) / static_cast<float>(width);
+	const float scale_y = static_cast<float>(source_height) / static_cast<float>(height);
+
+	cg::resource<float3> upscaled(width, height);
+	parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		std::array<std::array<float3, 4>, 4> colors;
+		std::array<std::array<float, 4>, 4> lumas;
+
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				const float source_x = (static_cast<float>(x) + 0.5f) * scale_x - 0.5f;
+				const float source_y = (static_cast<float>(y) + 0.5f) * scale_y - 0.5f;
+				const int base_x = static_cast<int>(std::floor(source_x));
+				const int base_y = static_cast<int>(std::floor(source_y));
+				const float2 fraction{source_x - static_cast<float>(base_x), source_y - static_cast<float>(base_y)};
+
+				for (int j = 0; j != 4; ++j) {
+					for (int i = 0; i != 4; ++i) {
+						colors[j][i] = fetch(base_x + i - 1, base_y + j - 1);
+						lumas[j][i] = luma(colors[j][i]);
+					}
+				}
+
+				// Edge direction and strength from the four texels around the sample, bilinearly weighted
+				float2 direction{0.0f, 0.0f};
+				float length = 0.0f;
+				for (int j = 1; j != 3; ++j) {
+					for (int i = 1; i != 3; ++i) {
+						const float weight = (i == 1 ? 1.0f - fraction.x : fraction.x) * (j == 1 ? 1.0f - fraction.y : fraction.y);
+						const float center = lumas[j][i];
+
+						const float dx = lumas[j][i + 1] - lumas[j][i - 1];
+						const float dy = lumas[j + 1][i] - lumas[j - 1][i];
+						const float max_x = std::max(std::abs(lumas[j][i + 1] - center), std::abs(center - lumas[j][i - 1]));
+						const float max_y = std::max(std::abs(lumas[j + 1][i] - center), std::abs(center - lumas[j - 1][i]));
+						const float length_x = max_x > 0.0f ? std::clamp(std::abs(dx) / max_x, 0.0f, 1.0f) : 0.0f;
+						const float length_y = max_y > 0.0f ? std::clamp(std::abs(dy) / max_y, 0.0f, 1.0f) : 0.0f;
+
+						direction += float2{dx, dy} * weight;
+						length += (length_x * length_x + length_y * length_y) * weight;
+					}
+				}
+
+				const float direction2 = direction.x * direction.x + direction.y * direction.y;
+				if (direction2 < 1.0f / 32768.0f) {
+					direction = {1.0f, 0.0f};
+				}
+				else {
+					direction /= std::sqrt(direction2);
+				}
+				length *= 0.5f;
+				length *= length;
+
+				// Stretch along the edge, shrink across it
+				const float stretch = 1.0f / std::max(std::abs(direction.x), std::abs(direction.y));
+				const float2 axis_stretch{1.0f + (stretch - 1.0f) * length, 1.0f - 0.5f * length};
+				const float lobe = 0.5f + ((1.0f / 4.0f - 0.04f) - 0.5f) * length;
+				const float clip = 1.0f / lobe;
+
+				float3 sum{0.0f, 0.0f, 0.0f};
+				float weight_sum = 0.0f;
+				for (int j = 0; j != 4; ++j) {
+					for (int i = 0; i != 4; ++i) {
+						const float2 offset{static_cast<float>(i - 1) - fraction.x, static_cast<float>(j - 1) - fraction.y};
+						const float weight = easu_weight(offset, direction, axis_stretch, lobe, clip);
+						sum += colors[j][i] * weight;
+						weight_sum += weight;
+					}
+				}
+
+				// Deringing against the nearest texels
+				const float3 minimum = min(min(colors[1][1], colors[1][2]), min(colors[2][1], colors[2][2]));
+				const float3 maximum = max(max(colors[1][1], colors[1][2]), max(colors[2][1], colors[2][2]));
+				upscaled.item(x, y) = clamp(sum / weight_sum, minimum, maximum);
+			}
+		}
+	});
+
+	const float sharpening = std::exp2(-sharpness);
+	const int last_x = static_cast<int>(width) - 1;
+	const int last_y = static_cast<int>(height) - 1;
+	parallel_for_tiles(width, height, tile_size, [&](size_t x_begin, size_t y_begin, size_t x_end, size_t y_end) {
+		for (size_t y = y_begin; y != y_end; ++y) {
+			for (size_t x = x_begin; x != x_end; ++x) {
+				const int ix = static_cast<int>(x);
+				const int iy = static_cast<int>(y);
+				const float3 center = upscaled.item(x, y);
+				const float3 north = upscaled.item(x, static_cast<size_t>(std::max(iy - 1, 0)));
+				const float3 south = upscaled.item(x, static_cast<size_t>(std::min(iy + 1, last_y)));
+				const float3 west = upscaled.item(static_cast<size_t>(std::max(ix - 1, 0)), y);
+				const float3 east = upscaled.item(static_cast<size_t>(std::min(ix + 1, last_x)), y);
+
+				// The strongest negative lobe that keeps the cross within [0, 1]
+				const float3 minimum = min(min(min(north, south), min(west, east)), center);
+				const float3 maximum = max(max(max(north, south), max(west, east)), center);
+				float lobe = -0.25f;
+				for (int channel = 0; channel != 3; ++channel) {
+					const float hit_min = maximum[channel] > 0.0f ? minimum[channel] / (4.0f * maximum[channel]) : 0.0f;
+					const float hit_max = minimum[channel] < 1.0f ? (1.0f - maximum[channel]) / (4.0f * minimum[channel] - 4.0f) : 0.0f;
+					lobe = std::max(lobe, std::max(-hit_min, hit_max));
+				}
+				lobe = std::clamp(lobe, -(0.25f - 1.0f / 16.0f), 0.0f) * sharpening;
+
+				const float3 sharpened = (center + (north + south + west + east) * lobe) / (4.0f * lobe + 1.0f);
+				destination.item(x, y) = cg::unsigned_color::from_float3(sharpened);
+			}
+		}
+	});
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "resource.h"
+
+
+namespace cg::utils
+{
+	// Edge adaptive spatial upsampling followed by contrast adaptive sharpening, a CPU take on
+	// AMD FidelityFX Super Resolution 1 (EASU + RCAS). Sharpness is in stops, 0 is the strongest.
+	void upscale(const cg::resource<cg::unsigned_color>& source, cg::resource<cg::unsigned_color>& destination, float sharpness);
+}// namespace cg::utils
@@ -5,7 +5,9 @@
 #include "utils/error_handler.h"
 
 #include <DirectXMath.h>
+#include <cfloat>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
 #include <random>
 #include <set>
@@ -36,6 +38,24 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 		THROW_ERROR(error_message);
 	}
 
+	material_table.clear();
+	material_table.reserve(materials.size() + 1);
+	for (const tinyobj::material_t& source: materials) {
+		material_table.push_back({DirectX::XMFLOAT3(source.ambient),
+								  DirectX::XMFLOAT3(source.diffuse),
+								  DirectX::XMFLOAT3(source.specular),
+								  DirectX::XMFLOAT3(source.emission),
+								  source.shininess});
+	}
+
+	// Faces without a material reference the trailing default one
+	const unsigned int default_material_id = static_cast<unsigned int>(material_table.size());
+	material_table.push_back({{0.1f, 0.1f, 0.1f}, {0.8f, 0.8f, 0.8f}, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, 1.0f});
+
+	if (material_table.size() > 65536) {
+		THROW_ERROR("Too many materials for 16-bit material ids");
+	}
+
 	const size_t num_vertices = attrib.vertices.size() / 3;
 	std::vector<vertex> vertices(num_vertices);
 	for (size_t i = 0; i != num_vertices; ++i)
@@ -52,47 +72,179 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 			if (index_map.count(index) == 0) {
 				const unsigned int local_index = static_cast<unsigned int>(vertex_accumulator.size());
 				vertex_accumulator.push_back(vertices[index]);
-
-				vertex_accumulator.back().diffuse = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].diffuse);
-				vertex_accumulator.back().ambient = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].ambient);
-				vertex_accumulator.back().specular = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].specular);
-				vertex_accumulator.back().emissive = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].emission);
-
-				vertex_accumulator.back().shininess = materials[mesh.material_ids[i / 3]].shininess;
-
 				index_map[index] = local_index;
 			}
 		}
 
-		auto index_buffer = std::make_shared<resource<unsigned int>>(mesh.indices.size());
+		std::vector<unsigned int> indices(mesh.indices.size());
 		for (size_t i = 0; i != mesh.indices.size(); ++i) {
-			index_buffer->item(i) = index_map[mesh.indices[mesh.indices.size() - i - 1].vertex_index];
+			indices[i] = index_map[mesh.indices[mesh.indices.size() - i - 1].vertex_index];
+		}
+
+		// Faces are emitted in reverse order, so their materials are as well
+		const size_t num_faces = mesh.indices.size() / 3;
+		std::vector<uint16_t> face_materials(num_faces);
+		for (size_t i = 0; i != num_faces; ++i) {
+			const int material_id = mesh.material_ids[num_faces - i - 1];
+			face_materials[i] = static_cast<uint16_t>(material_id < 0 ? default_material_id : material_id);
+		}
+
+		optimize_triangle_order(indices, face_materials, vertex_accumulator.size());
+		optimize_vertex_order(indices, vertex_accumulator);
+
+		compact_index_buffer index_buffer(indices.size(), vertex_accumulator.size());
+		for (size_t i = 0; i != indices.size(); ++i) {
+			index_buffer.set_item(i, indices[i]);
 		}
 
-		auto vertex_buffer = std::make_shared<resource<vertex>>(vertex_accumulator.size());
+		auto material_id_buffer = std::make_shared<resource<uint16_t>>(num_faces);
+		for (size_t i = 0; i != num_faces; ++i) {
+			material_id_buffer->item(i) = face_materials[i];
+		}
+
+		DirectX::XMVECTOR bounds_min = DirectX::XMVectorReplicate(FLT_MAX);
+		DirectX::XMVECTOR bounds_max = DirectX::XMVectorReplicate(-FLT_MAX);
+		for (const vertex& v: vertex_accumulator) {
+			bounds_min = DirectX::XMVectorMin(bounds_min, DirectX::XMLoadFloat3(&v.position));
+			bounds_max = DirectX::XMVectorMax(bounds_max, DirectX::XMLoadFloat3(&v.position));
+		}
+		DirectX::XMFLOAT3 min, max;
+		DirectX::XMStoreFloat3(&min, bounds_min);
+		DirectX::XMStoreFloat3(&max, bounds_max);
+		const vertex_quantization quantization = vertex_quantization::from_bounds(min, max);
+
+		auto vertex_buffer = std::make_shared<resource<compact_vertex>>(vertex_accumulator.size());
 		for (size_t i = 0; i != vertex_accumulator.size(); ++i) {
-			vertex_buffer->item(i) = vertex_accumulator[i];
+			vertex_buffer->item(i) = compact_vertex::encode(vertex_accumulator[i], quantization);
 		}
 
 		vertex_buffers.emplace_back(vertex_buffer);
+		vertex_quantizations.emplace_back(quantization);
 		index_buffers.emplace_back(index_buffer);
+		material_id_buffers.emplace_back(material_id_buffer);
 	}
 }
 
 
-const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>&
+const std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>>&
 cg::world::model::get_vertex_buffers() const
 {
 	return vertex_buffers;
 }
 
 
-const std::vector<std::shared_ptr<cg::resource<unsigned int>>>&
+const std::vector<cg::vertex_quantization>&
+cg::world::model::get_vertex_quantizations() const
+{
+	return vertex_quantizations;
+}
+
+
+const std::vector<cg::compact_index_buffer>&
 cg::world::model::get_index_buffers() const
 {
 	return index_buffers;
 }
 
+
+const std::vector<std::shared_ptr<cg::resource<uint16_t>>>&
+cg::world::model::get_material_id_buffers() const
+{
+	return material_id_buffers;
+}
+
+
+const std::vector<cg::material>&
+cg::world::model::get_materials() const
+{
+	return material_table;
+}
+
+
+void cg::world::model::set_material(size_t material_id, const cg::material& in_material)
+{
+	material_table.at(material_id) = in_material;
+}
+
+
+void cg::world::model::rotate_shape(size_t shape, float angle)
+{
+	using namespace DirectX;
+
+	resource<compact_vertex>& vertex_buffer = *vertex_buffers.at(shape);
+	const vertex_quantization& quantization = vertex_quantizations[shape];
+	const XMFLOAT3 shape_min = quantization.get_min();
+	const XMFLOAT3 shape_max = quantization.get_max();
+	const XMVECTOR center = XMVectorScale(XMVectorAdd(XMLoadFloat3(&shape_min), XMLoadFloat3(&shape_max)), 0.5f);
+	const XMMATRIX transform = XMMatrixMultiply(
+			XMMatrixMultiply(XMMatrixTranslationFromVector(XMVectorNegate(center)), XMMatrixRotationY(angle)),
+			XMMatrixTranslationFromVector(center));
+
+	std::vector<vertex> vertices(vertex_buffer.get_number_of_elements());
+	XMVECTOR bounds_min = XMVectorReplicate(FLT_MAX);
+	XMVECTOR bounds_max = XMVectorReplicate(-FLT_MAX);
+	for (size_t i = 0; i != vertices.size(); ++i) {
+		vertices[i] = vertex_buffer.item(i).decode(quantization);
+		const XMVECTOR position = XMVector3TransformCoord(XMLoadFloat3(&vertices[i].position), transform);
+		XMStoreFloat3(&vertices[i].position, position);
+		XMStoreFloat3(&vertices[i].normal, XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&vertices[i].normal), transform)));
+		bounds_min = XMVectorMin(bounds_min, position);
+		bounds_max = XMVectorMax(bounds_max, position);
+	}
+
+	XMFLOAT3 min, max;
+	XMStoreFloat3(&min, bounds_min);
+	XMStoreFloat3(&max, bounds_max);
+	vertex_quantizations[shape] = vertex_quantization::from_bounds(min, max);
+	for (size_t i = 0; i != vertices.size(); ++i) {
+		vertex_buffer.item(i) = compact_vertex::encode(vertices[i], vertex_quantizations[shape]);
+	}
+}
+
+
+const std::vector<point_light>& cg::world::model::get_lights() const
+{
+	return lights;
+}
+
+
+void cg::world::model::add_light(const point_light& in_light)
+{
+	lights.push_back(in_light);
+}
+
+
+void cg::world::model::add_random_lights(size_t count, float range, unsigned int seed)
+{
+	if (vertex_quantizations.empty()) {
+		return;
+	}
+
+	DirectX::XMVECTOR bounds_min = DirectX::XMVectorReplicate(FLT_MAX);
+	DirectX::XMVECTOR bounds_max = DirectX::XMVectorReplicate(-FLT_MAX);
+	for (const vertex_quantization& quantization: vertex_quantizations) {
+		const DirectX::XMFLOAT3 shape_min = quantization.get_min();
+		const DirectX::XMFLOAT3 shape_max = quantization.get_max();
+		bounds_min = DirectX::XMVectorMin(bounds_min, DirectX::XMLoadFloat3(&shape_min));
+		bounds_max = DirectX::XMVectorMax(bounds_max, DirectX::XMLoadFloat3(&shape_max));
+	}
+	DirectX::XMFLOAT3 min, max;
+	DirectX::XMStoreFloat3(&min, bounds_min);
+	DirectX::XMStoreFloat3(&max, bounds_max);
+
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (size_t i = 0; i != count; ++i) {
+		point_light light;
+		light.position = {min.x + unit(generator) * (max.x - min.x),
+						  min.y + unit(generator) * (max.y - min.y),
+						  min.z + unit(generator) * (max.z - min.z)};
+		light.color = {unit(generator), unit(generator), unit(generator)};
+		light.range = range;
+		lights.push_back(light);
+	}
+}
+
 std::vector<std::filesystem::path>
 cg::world::model::get_per_shape_texture_files() const
 {
@@ -103,4 +255,125 @@ cg::world::model::get_per_shape_texture_files() const
 const DirectX::XMMATRIX cg::world::model::get_world_matrix() const
 {
 	return DirectX::XMMatrixRotationY(0);
-}
\ No newline at end of file
+}
+
+void cg::world::model::optimize_triangle_order(
+		std::vector<unsigned int>& indices, std::vector<uint16_t>& face_materials, size_t num_vertices)
+{
+	// Tipsify (Sander, Nehab, Barczak 2007): fan around the most recently cached vertex
+	// and jump to a dead-end vertex or the next live one when the fan runs out
+	constexpr int cache_size = 16;
+
+	const size_t num_faces = indices.size() / 3;
+	if (num_faces == 0) {
+		return;
+	}
+
+	std::vector<unsigned int> adjacency_offsets(num_vertices + 1, 0);
+	for (unsigned int index: indices) {
+		++adjacency_offsets[index + 1];
+	}
+	for (size_t v = 0; v != num_vertices; ++v) {
+		adjacency_offsets[v + 1] += adjacency_offsets[v];
+	}
+
+	std::vector<unsigned int> adjacency(indices.size());
+	std::vector<unsigned int> fill = adjacency_offsets;
+	for (size_t i = 0; i != indices.size(); ++i) {
+		adjacency[fill[indices[i]]++] = static_cast<unsigned int>(i / 3);
+	}
+
+	std::vector<int> live_triangles(num_vertices);
+	for (size_t v = 0; v != num_vertices; ++v) {
+		live_triangles[v] = static_cast<int>(adjacency_offsets[v + 1] - adjacency_offsets[v]);
+	}
+
+	std::vector<int> cache_time(num_vertices, 0);
+	std::vector<bool> emitted(num_faces, false);
+	std::vector<unsigned int> dead_end;
+	std::vector<unsigned int> candidates;
+
+	std::vector<unsigned int> output_indices;
+	std::vector<uint16_t> output_materials;
+	output_indices.reserve(indices.size());
+	output_materials.reserve(num_faces);
+
+	int time_stamp = cache_size + 1;
+	size_t cursor = 0;
+	long long fanning = indices[0];
+
+	while (fanning >= 0) {
+		candidates.clear();
+		for (unsigned int a = adjacency_offsets[fanning]; a != adjacency_offsets[fanning + 1]; ++a) {
+			const unsigned int face = adjacency[a];
+			if (emitted[face]) {
+				continue;
+			}
+			for (size_t corner = 0; corner != 3; ++corner) {
+				const unsigned int v = indices[3 * face + corner];
+				output_indices.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				--live_triangles[v];
+				if (time_stamp - cache_time[v] > cache_size) {
+					cache_time[v] = time_stamp++;
+				}
+			}
+			output_materials.push_back(face_materials[face]);
+			emitted[face] = true;
+		}
+
+		// Prefer the candidate that stays in cache longest while still having triangles to fan
+		fanning = -1;
+		int best_priority = -1;
+		for (unsigned int v: candidates) {
+			if (live_triangles[v] <= 0) {
+				continue;
+			}
+			int priority = 0;
+			if (time_stamp - cache_time[v] + 2 * live_triangles[v] <= cache_size) {
+				priority = time_stamp - cache_time[v];
+			}
+			if (priority > best_priority) {
+				best_priority = priority;
+				fanning = v;
+			}
+		}
+
+		while (fanning < 0 && !dead_end.empty()) {
+			const unsigned int v = dead_end.back();
+			dead_end.pop_back();
+			if (live_triangles[v] > 0) {
+				fanning = v;
+			}
+		}
+
+		for (; fanning < 0 && cursor != num_vertices; ++cursor) {
+			if (live_triangles[cursor] > 0) {
+				fanning = static_cast<long long>(cursor);
+			}
+		}
+	}
+
+	indices.swap(output_indices);
+	face_materials.swap(output_materials);
+}
+
+void cg::world::model::optimize_vertex_order(std::vector<unsigned int>& indices, std::vector<vertex>& vertices)
+{
+	constexpr unsigned int unassigned = std::numeric_limits<unsigned int>::max();
+
+	std::vector<unsigned int> remap(vertices.size(), unassigned);
+	std::vector<vertex> reordered;
+	reordered.reserve(vertices.size());
+
+	for (unsigned int& index: indices) {
+		if (remap[index] == unassigned) {
+			remap[index] = static_cast<unsigned int>(reordered.size());
+			reordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+
+	vertices.swap(reordered);
+}
@@ -11,6 +11,14 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+	struct point_light
+	{
+		DirectX::XMFLOAT3 position;
+		DirectX::XMFLOAT3 color;
+		// Distance at which the contribution fades to zero
+		float range;
+	};
+
 	class model
 	{
 	public:
@@ -19,9 +27,29 @@ namespace cg::world
 
 		void load_obj(const std::filesystem::path& model_path);
 
-		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
+		const std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>>& get_vertex_buffers() const;
+
+		const std::vector<cg::vertex_quantization>& get_vertex_quantizations() const;
+
+		const std::vector<cg::compact_index_buffer>& get_index_buffers() const;
+
+		// One id per triangle, indexing get_materials()
+		const std::vector<std::shared_ptr<cg::resource<uint16_t>>>& get_material_id_buffers() const;
+
+		const std::vector<cg::material>& get_materials() const;
 
-		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
+		void set_material(size_t material_id, const cg::material& in_material);
+
+		// Turns a shape about the vertical axis through the centre of its bounds. The vertex buffer is
+		// rewritten in place with a new quantization, so the shape keeps its buffers.
+		void rotate_shape(size_t shape, float angle);
+
+		const std::vector<point_light>& get_lights() const;
+
+		void add_light(const point_light& in_light);
+
+		// Scatters lights with random colours inside the bounds of the loaded geometry
+		void add_random_lights(size_t count, float range, unsigned int seed = 0);
 
 		std::vector<std::filesystem::path> get_per_shape_texture_files() const;
 
@@ -32,10 +60,21 @@ namespace cg::world
 		std::vector<tinyobj::shape_t> shapes;
 		std::vector<tinyobj::material_t> materials;
 
-		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
+		std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>> vertex_buffers;
+		std::vector<cg::vertex_quantization> vertex_quantizations;
 
-		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
+		std::vector<cg::compact_index_buffer> index_buffers;
+
+		std::vector<std::shared_ptr<cg::resource<uint16_t>>> material_id_buffers;
+		std::vector<cg::material> material_table;
+
+		std::vector<point_light> lights;
 
 		std::vector<std::filesystem::path> textures;
+
+		// Reorders faces for post-transform vertex cache locality, keeping winding and materials
+		static void optimize_triangle_order(std::vector<unsigned int>& indices, std::vector<uint16_t>& face_materials, size_t num_vertices);
+		// Renumbers vertices in order of first use by the index buffer
+		static void optimize_vertex_order(std::vector<unsigned int>& indices, std::vector<cg::vertex>& vertices);
 	};
 }// namespace cg::world
\ No newline at end of file